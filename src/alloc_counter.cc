@@ -0,0 +1,123 @@
+#include "src/cpp_common/cpppromise/alloc_counter.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace cpppromise {
+
+std::atomic<bool> counting_allocations{false};
+std::atomic<long> allocation_count{0};
+
+}  // namespace cpppromise
+
+// Replace the whole family of global allocation functions, so that every form
+// of new is counted, and every form of delete frees with the matching call.
+void *operator new(std::size_t size) {
+  if (cpppromise::counting_allocations.load(std::memory_order_relaxed)) {
+    cpppromise::allocation_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  void *p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  if (cpppromise::counting_allocations.load(std::memory_order_relaxed)) {
+    cpppromise::allocation_count.fetch_add(1, std::memory_order_relaxed);
+  }
+  // aligned_alloc wants the size to be a multiple of the alignment.
+  std::size_t align = static_cast<std::size_t>(alignment);
+  void *p = std::aligned_alloc(align, (size / align + 1) * align);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return operator new(size);
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return operator new(size, std::nothrow);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  try {
+    return operator new(size, alignment);
+  } catch (const std::bad_alloc &) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return operator new(size, alignment, std::nothrow);
+}
+
+// The forms of delete are kept out of line: once inlined next to a call to
+// operator new, GCC sees free called on what new returned, and warns.
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+
+[[gnu::noinline]] void operator delete[](void *p) noexcept { std::free(p); }
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t,
+                                       std::align_val_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::size_t,
+                                         std::align_val_t) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p,
+                                       const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p,
+                                         const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::align_val_t,
+                                       const std::nothrow_t &) noexcept {
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::align_val_t,
+                                         const std::nothrow_t &) noexcept {
+  std::free(p);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <atomic>
+
+// Linking this in replaces the global operator new and operator delete, so
+// that tests and benchmarks can count the heap allocations that some piece of
+// code makes. For tests and benchmarks only.
+namespace cpppromise {
+
+// While this is set, every heap allocation made by any thread is counted in
+// allocation_count.
+extern std::atomic<bool> counting_allocations;
+extern std::atomic<long> allocation_count;
+
+}  // namespace cpppromise
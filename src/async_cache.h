@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+#include "promise.h"
+
+namespace cpppromise {
+
+// An AsyncCache remembers the Promises returned by a load function, by key, so
+// that a value is loaded once and then shared by everyone who asks for it. A
+// lookup that comes in while the value is still being loaded gets the same
+// Promise as the one that started the load, rather than starting another one,
+// so a burst of requests for one key costs a single load.
+//
+// Values are evicted when they have been loaded for longer than a time to
+// live, and, least recently used first, when the cache holds more than its
+// capacity. Values still being loaded are never evicted, so that every lookup
+// for them keeps sharing the one load; the cache may hold more than its
+// capacity until they are done. A load whose Promise is cancelled is not
+// cached, so the next lookup tries again.
+//
+// Each lookup gets a copy of the value. For large values, make V a
+// std::shared_ptr<const ...>.
+//
+// All of the methods can be called from any thread.
+template <typename K, typename V>
+class AsyncCache {
+ public:
+  using Loader = std::function<Promise<V>(const K &key)>;
+
+  struct Stats {
+    // Lookups that found the value loaded already.
+    long hits = 0;
+    // Lookups that started a load.
+    long misses = 0;
+    // Lookups that found the value still being loaded, and waited for it.
+    long coalesced = 0;
+    // Values that were evicted to stay within capacity.
+    long evictions = 0;
+    // Values that were evicted because they outlived their time to live.
+    long expirations = 0;
+  };
+
+  // Make a cache that loads values with load, and holds at most capacity of
+  // them, or any number if capacity is zero, each for at most ttl after it is
+  // loaded, or until it is evicted if ttl is zero.
+  explicit AsyncCache(Loader load, size_t capacity = 0,
+                      std::chrono::nanoseconds ttl = {});
+
+  // Cancels the timers of the values that are left. The Promises already
+  // handed out are still resolved.
+  ~AsyncCache();
+
+  AsyncCache(const AsyncCache &) = delete;
+  AsyncCache &operator=(const AsyncCache &) = delete;
+
+  // Return a Promise of the value for key, loading it unless it is cached, or
+  // being loaded, already.
+  Promise<V> Get(const K &key);
+
+  // Forget the value for key, if any, so that the next lookup loads it again.
+  // Those waiting for it still get it.
+  void Invalidate(const K &key);
+
+  size_t Size();
+
+  Stats GetStats();
+
+ private:
+  struct Entry {
+    Entry(Promise<V> promise, uint64_t generation)
+        : promise(std::move(promise)), generation(generation) {}
+
+    Promise<V> promise;
+    // Tells this entry apart from those that had the same key before it, so
+    // that a load or a timer meant for one of those leaves it alone.
+    uint64_t generation;
+    bool loaded = false;
+    // The timer that expires this entry, if any.
+    std::optional<uint64_t> timer;
+    typename std::list<K>::iterator lru;
+  };
+
+  // What the timers and the loads that are still running refer to, so that
+  // they can tell if the cache is gone.
+  struct State {
+    Loader load;
+    size_t capacity;
+    std::chrono::nanoseconds ttl;
+    std::mutex mu;
+    // Guarded by mu.
+    std::unordered_map<K, Entry> entries;
+    // The keys of the entries, most recently used first. Guarded by mu.
+    std::list<K> lru;
+    uint64_t next_generation = 0;
+    Stats stats;
+  };
+
+  // Called once the load of the entry for key with the given generation is
+  // done, with whether it was successful.
+  static void Loaded(const std::weak_ptr<State> &weak_state, const K &key,
+                     uint64_t generation, bool ok);
+  // Called when the entry for key with the given generation expires.
+  static void Expire(const std::weak_ptr<State> &weak_state, const K &key,
+                     uint64_t generation);
+  // Evict loaded entries, least recently used first, until the cache is within
+  // its capacity or has no loaded entries left. Must hold mu.
+  static void Trim(State *state);
+  // Remove the entry that it points to. Must hold mu.
+  static void Erase(State *state,
+                    typename std::unordered_map<K, Entry>::iterator it);
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace cpppromise
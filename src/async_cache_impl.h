@@ -0,0 +1,175 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "async_cache.h"
+#include "event_queue.h"
+#include "resolver.h"
+#include "timer.h"
+
+namespace cpppromise {
+
+template <typename K, typename V>
+AsyncCache<K, V>::AsyncCache(Loader load, size_t capacity,
+                             std::chrono::nanoseconds ttl)
+    : state_(std::make_shared<State>()) {
+  state_->load = std::move(load);
+  state_->capacity = capacity;
+  state_->ttl = ttl;
+}
+
+template <typename K, typename V>
+AsyncCache<K, V>::~AsyncCache() {
+  std::lock_guard<std::mutex> lock(state_->mu);
+  for (auto &entry : state_->entries) {
+    if (entry.second.timer) {
+      Timer::Get()->Cancel(*entry.second.timer);
+    }
+  }
+}
+
+template <typename K, typename V>
+Promise<V> AsyncCache<K, V>::Get(const K &key) {
+  State *state = state_.get();
+  std::optional<std::pair<Promise<V>, Resolver<V>>> pair;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(state->mu);
+    auto it = state->entries.find(key);
+    if (it != state->entries.end()) {
+      Entry &entry = it->second;
+      state->lru.splice(state->lru.begin(), state->lru, entry.lru);
+      if (entry.loaded) {
+        state->stats.hits++;
+      } else {
+        state->stats.coalesced++;
+      }
+      return entry.promise;
+    }
+    state->stats.misses++;
+    pair.emplace(EventQueue::CreateResolver<V>());
+    generation = state->next_generation++;
+    state->lru.push_front(key);
+    it = state->entries.emplace(key, Entry(pair->first, generation)).first;
+    it->second.lru = state->lru.begin();
+    Trim(state);
+  }
+  // Load outside the lock, since the loader, and those waiting for the value,
+  // may well look up other keys.
+  std::weak_ptr<State> weak_state = state_;
+  PromiseInternal::OnResult(
+      state->load(key), [weak_state, key, generation,
+                         resolver = std::move(pair->second)](V *value) mutable {
+        Loaded(weak_state, key, generation, value != nullptr);
+        if (value) {
+          resolver.Resolve(std::move(*value));
+        } else {
+          resolver.Cancel();
+        }
+      });
+  return pair->first;
+}
+
+template <typename K, typename V>
+void AsyncCache<K, V>::Invalidate(const K &key) {
+  std::lock_guard<std::mutex> lock(state_->mu);
+  auto it = state_->entries.find(key);
+  if (it != state_->entries.end()) {
+    Erase(state_.get(), it);
+  }
+}
+
+template <typename K, typename V>
+size_t AsyncCache<K, V>::Size() {
+  std::lock_guard<std::mutex> lock(state_->mu);
+  return state_->entries.size();
+}
+
+template <typename K, typename V>
+typename AsyncCache<K, V>::Stats AsyncCache<K, V>::GetStats() {
+  std::lock_guard<std::mutex> lock(state_->mu);
+  return state_->stats;
+}
+
+template <typename K, typename V>
+void AsyncCache<K, V>::Loaded(const std::weak_ptr<State> &weak_state,
+                              const K &key, uint64_t generation, bool ok) {
+  std::shared_ptr<State> state = weak_state.lock();
+  if (!state) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(state->mu);
+  auto it = state->entries.find(key);
+  if (it == state->entries.end() || it->second.generation != generation) {
+    return;
+  }
+  if (!ok) {
+    Erase(state.get(), it);
+    return;
+  }
+  it->second.loaded = true;
+  if (state->ttl.count() > 0) {
+    // The Timer runs its tasks without holding its own lock, so it is safe to
+    // call it while holding ours.
+    it->second.timer = Timer::Get()->Schedule(
+        Timer::Get()->Now() + state->ttl, [weak_state, key, generation]() {
+          Expire(weak_state, key, generation);
+        });
+  }
+  // Trim may have had to skip this entry while it was being loaded.
+  Trim(state.get());
+}
+
+template <typename K, typename V>
+void AsyncCache<K, V>::Expire(const std::weak_ptr<State> &weak_state,
+                              const K &key, uint64_t generation) {
+  std::shared_ptr<State> state = weak_state.lock();
+  if (!state) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(state->mu);
+  auto it = state->entries.find(key);
+  if (it == state->entries.end() || it->second.generation != generation) {
+    return;
+  }
+  // The timer has run, so there is nothing left to cancel.
+  it->second.timer.reset();
+  Erase(state.get(), it);
+  state->stats.expirations++;
+}
+
+template <typename K, typename V>
+void AsyncCache<K, V>::Trim(State *state) {
+  if (state->capacity == 0) {
+    return;
+  }
+  // next is just after the candidate, so that erasing the candidate leaves it
+  // valid.
+  auto next = state->lru.end();
+  while (state->entries.size() > state->capacity &&
+         next != state->lru.begin()) {
+    auto it = state->entries.find(*std::prev(next));
+    if (it->second.loaded) {
+      Erase(state, it);
+      state->stats.evictions++;
+    } else {
+      next--;
+    }
+  }
+}
+
+template <typename K, typename V>
+void AsyncCache<K, V>::Erase(
+    State *state, typename std::unordered_map<K, Entry>::iterator it) {
+  if (it->second.timer) {
+    Timer::Get()->Cancel(*it->second.timer);
+  }
+  state->lru.erase(it->second.lru);
+  state->entries.erase(it);
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,136 @@
+#include "src/cpp_common/cpppromise/async_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/cpp_common/cpppromise/cpppromise.h"
+
+namespace cpppromise {
+namespace {
+
+TEST(AsyncCacheTest, ConcurrentLookupsShareOneLoad) {
+  std::atomic<int> loads(0);
+  std::vector<Resolver<int>> pending;
+  AsyncCache<int, int> cache([&](const int &key) {
+    loads++;
+    auto pair = EventQueue::CreateResolver<int>();
+    pending.push_back(pair.second);
+    return pair.first;
+  });
+  EventQueue q;
+  std::atomic<int> sum(0);
+  for (int i = 0; i < 100; i++) {
+    cache.Get(7).Then(&q, [&sum](int k) { sum += k; });
+  }
+  ASSERT_EQ(pending.size(), 1u);
+  pending[0].Resolve(3);
+  cache.Get(7).Then(&q, [&sum](int k) { sum += k; });
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(loads.load(), 1);
+  EXPECT_EQ(sum.load(), 101 * 3);
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.coalesced, 99);
+  EXPECT_EQ(stats.hits, 1);
+}
+
+TEST(AsyncCacheTest, EvictsTheLeastRecentlyUsed) {
+  std::vector<int> loaded;
+  AsyncCache<int, int> cache(
+      [&loaded](const int &key) {
+        loaded.push_back(key);
+        return EventQueue::CreateResolvedPromise<int>(key * 10);
+      },
+      2);
+  cache.Get(1);
+  cache.Get(2);
+  cache.Get(1);
+  cache.Get(3);  // Evicts 2
+  cache.Get(1);
+  cache.Get(2);  // Evicts 3
+  EXPECT_EQ(loaded, (std::vector<int>{1, 2, 3, 2}));
+  EXPECT_EQ(cache.Size(), 2u);
+  EXPECT_EQ(cache.GetStats().evictions, 2);
+}
+
+TEST(AsyncCacheTest, DoesNotEvictValuesBeingLoaded) {
+  std::vector<int> loaded;
+  std::vector<Resolver<int>> pending;
+  AsyncCache<int, int> cache(
+      [&](const int &key) {
+        loaded.push_back(key);
+        auto pair = EventQueue::CreateResolver<int>();
+        pending.push_back(pair.second);
+        return pair.first;
+      },
+      1);
+  EventQueue q;
+  std::atomic<int> sum(0);
+  cache.Get(1).Then(&q, [&sum](int k) { sum += k; });
+  cache.Get(2).Then(&q, [&sum](int k) { sum += k; });
+  // Still shares the first load, rather than starting another.
+  cache.Get(1).Then(&q, [&sum](int k) { sum += k; });
+  EXPECT_EQ(loaded, (std::vector<int>{1, 2}));
+  EXPECT_EQ(cache.Size(), 2u);
+  EXPECT_EQ(cache.GetStats().evictions, 0);
+  ASSERT_EQ(pending.size(), 2u);
+  pending[0].Resolve(10);
+  pending[1].Resolve(20);
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(sum.load(), 10 + 20 + 10);
+  EXPECT_EQ(cache.Size(), 1u);
+  EXPECT_EQ(cache.GetStats().evictions, 1);
+}
+
+TEST(AsyncCacheTest, ValuesExpire) {
+  std::atomic<int> loads(0);
+  AsyncCache<int, int> cache(
+      [&loads](const int &key) {
+        loads++;
+        return EventQueue::CreateResolvedPromise<int>(key);
+      },
+      0, std::chrono::milliseconds(10));
+  cache.Get(1);
+  cache.Get(1);
+  EXPECT_EQ(loads.load(), 1);
+  while (cache.Size() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  cache.Get(1);
+  EXPECT_EQ(loads.load(), 2);
+  EXPECT_EQ(cache.GetStats().expirations, 1);
+}
+
+TEST(AsyncCacheTest, CancelledLoadsAreNotCached) {
+  int loads = 0;
+  AsyncCache<int, int> cache([&loads](const int &key) {
+    auto pair = EventQueue::CreateResolver<int>();
+    if (loads++ == 0) {
+      pair.second.Cancel();
+    } else {
+      pair.second.Resolve(key);
+    }
+    return pair.first;
+  });
+  EventQueue q;
+  std::optional<int> first = 0;
+  std::optional<int> second;
+  cache.Get(5).Settled().Then(&q, [&first](std::optional<int> k) { first = k; });
+  EXPECT_EQ(cache.Size(), 0u);
+  cache.Get(5).Settled().Then(&q,
+                              [&second](std::optional<int> k) { second = k; });
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(first, std::nullopt);
+  EXPECT_EQ(second, 5);
+  EXPECT_EQ(loads, 2);
+}
+
+}  // namespace
+}  // namespace cpppromise
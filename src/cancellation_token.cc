@@ -0,0 +1,67 @@
+#include "cancellation_token.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "free_list_pool.h"
+
+namespace cpppromise {
+
+CancellationToken::CancellationToken() : state_(std::make_shared<State>()) {}
+
+void CancellationToken::Cancel() {
+  if (state_->cancelled.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  std::vector<std::shared_ptr<Callback>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    callbacks.swap(state_->callbacks);
+  }
+  for (auto &callback : callbacks) {
+    if (!callback->done.exchange(true, std::memory_order_acq_rel)) {
+      callback->f();
+    }
+  }
+}
+
+bool CancellationToken::IsCancelled() const {
+  return state_->cancelled.load(std::memory_order_acquire);
+}
+
+std::shared_ptr<CancellationToken::Callback> CancellationToken::OnCancel(
+    TaskFunction f) {
+  auto callback =
+      std::allocate_shared<Callback>(PoolAllocator<Callback>());
+  callback->f = std::move(f);
+  {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    if (!state_->cancelled.load(std::memory_order_acquire)) {
+      // Forget the callbacks that are done whenever the vector would grow, so
+      // that a long-lived token holds on to no more than twice as many as are
+      // still pending.
+      auto &callbacks = state_->callbacks;
+      if (callbacks.size() == callbacks.capacity()) {
+        callbacks.erase(
+            std::remove_if(callbacks.begin(), callbacks.end(),
+                           [](const std::shared_ptr<Callback> &c) {
+                             return c->done.load(std::memory_order_relaxed);
+                           }),
+            callbacks.end());
+      }
+      callbacks.push_back(callback);
+      return callback;
+    }
+  }
+  // Cancelled already, so Cancel takes, or has taken, the callbacks without
+  // this one.
+  if (!callback->done.exchange(true, std::memory_order_acq_rel)) {
+    callback->f();
+  }
+  return callback;
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "task_function.h"
+
+namespace cpppromise {
+
+template <typename T>
+class PromiseControlBlock;
+
+// A CancellationToken lets whoever asked for some work say that they no longer
+// want it. Pass one to EventQueue::Enqueue, or attach one to a Promise with
+// Promise::WithCancellation. Once it is cancelled, tasks that have not started
+// yet are skipped instead of run, and so are all the continuations added with
+// Then downstream of them. Each Promise they would have resolved is cancelled
+// instead, which Promise::Settled tells apart from a result. Work that is
+// already running is not interrupted, but can check IsCancelled itself.
+//
+// A CancellationToken is a value type: its copies share the same state.
+class CancellationToken {
+ public:
+  // Make a token that is not cancelled yet.
+  CancellationToken();
+
+  // Cancel the work that this token was given to. Only the first call has any
+  // effect.
+  void Cancel();
+
+  bool IsCancelled() const;
+
+ private:
+  template <typename T>
+  friend class PromiseControlBlock;
+
+  // A function to run once the token is cancelled. Whoever sets done first,
+  // Cancel or the owner of the callback, decides whether f runs.
+  struct Callback {
+    std::atomic<bool> done{false};
+    TaskFunction f;
+  };
+
+  struct State {
+    std::atomic<bool> cancelled{false};
+    std::mutex mu;
+    // The callbacks to run once this is cancelled, some of which may be done
+    // already. Guarded by mu.
+    std::vector<std::shared_ptr<Callback>> callbacks;
+  };
+
+  // Run f in the thread that cancels this token, or right away if it already
+  // is. Setting done on the returned Callback first keeps f from running, and
+  // lets the token forget about it.
+  std::shared_ptr<Callback> OnCancel(TaskFunction f);
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace cpppromise
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+#include "empty.h"
+#include "promise.h"
+#include "promise_control_block.h"
+
+namespace cpppromise {
+
+// Support for C++20 coroutines. A function that returns a Promise<T> can be a
+// coroutine. It starts running right away, on the caller's thread, and the
+// Promise it returns is resolved by its co_return. Within a coroutine that runs
+// in an EventQueue, a Promise can be co_awaited: the coroutine is suspended,
+// and resumed in that same EventQueue once the Promise is resolved. That is
+// what Then does, but without wrapping each step in a std::function and
+// another PromiseControlBlock:
+//
+//   Promise<int> Add(EventQueue *other, int k) {
+//     int j = co_await other->Enqueue<int>([]() { return 41; });
+//     co_return j + k;
+//   }
+//
+// A coroutine waiting for a Promise that is never resolved is never resumed,
+// and keeps its EventQueue from finishing. One waiting for a Promise that is
+// cancelled is destroyed instead of resumed, and the Promise it returns is
+// cancelled too.
+
+template <typename T>
+class PromiseCoroutineBase {
+ public:
+  PromiseCoroutineBase();
+
+  Promise<T> get_return_object();
+
+  std::suspend_never initial_suspend() noexcept { return {}; }
+
+  std::suspend_never final_suspend() noexcept { return {}; }
+
+  // Exceptions are not used in this library.
+  void unhandled_exception() { std::terminate(); }
+
+  // Cancel the Promise that the coroutine returns.
+  void Cancel();
+
+ protected:
+  std::shared_ptr<PromiseControlBlock<T>> pcb_;
+};
+
+// The promise_type of coroutines that return a Promise<T>.
+template <typename T>
+class PromiseCoroutine : public PromiseCoroutineBase<T> {
+ public:
+  void return_value(T value);
+};
+
+// Coroutines that return a Promise<Empty> end with a plain co_return, or by
+// running off the end.
+template <>
+class PromiseCoroutine<Empty> : public PromiseCoroutineBase<Empty> {
+ public:
+  void return_void();
+};
+
+template <typename T>
+class PromiseAwaiter {
+ public:
+  explicit PromiseAwaiter(const Promise<T> &promise);
+
+  bool await_ready();
+
+  template <typename U>
+  void await_suspend(std::coroutine_handle<PromiseCoroutine<U>> h);
+
+  T await_resume();
+
+ private:
+  std::shared_ptr<PromiseControlBlock<T>> pcb_;
+};
+
+template <typename T>
+PromiseAwaiter<T> operator co_await(const Promise<T> &promise);
+
+}  // namespace cpppromise
+
+template <typename T, typename... Args>
+struct std::coroutine_traits<cpppromise::Promise<T>, Args...> {
+  using promise_type = cpppromise::PromiseCoroutine<T>;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cassert>
+
+#include "coroutine.h"
+#include "event_queue.h"
+#include "promise_control_block_impl.h"
+#include "promise_impl.h"
+
+namespace cpppromise {
+
+template <typename T>
+PromiseCoroutineBase<T>::PromiseCoroutineBase()
+    : pcb_(PromiseControlBlock<T>::Create("")) {}
+
+template <typename T>
+Promise<T> PromiseCoroutineBase<T>::get_return_object() {
+  return Promise<T>(pcb_);
+}
+
+template <typename T>
+void PromiseCoroutine<T>::return_value(T value) {
+  this->pcb_->Resolve(std::move(value));
+}
+
+inline void PromiseCoroutine<Empty>::return_void() { pcb_->Resolve(Empty{}); }
+
+template <typename T>
+void PromiseCoroutineBase<T>::Cancel() {
+  pcb_->Cancel();
+}
+
+template <typename T>
+PromiseAwaiter<T>::PromiseAwaiter(const Promise<T> &promise)
+    : pcb_(promise.pcb_) {}
+
+template <typename T>
+bool PromiseAwaiter<T>::await_ready() {
+  return pcb_->Resolved();
+}
+
+template <typename T>
+template <typename U>
+void PromiseAwaiter<T>::await_suspend(
+    std::coroutine_handle<PromiseCoroutine<U>> h) {
+  assert(EventQueue::Get() != nullptr);
+  // The task holds nothing but the handle and this, which lives in the
+  // coroutine's frame, so it is stored inline.
+  pcb_->OnResolved(EventQueue::Get(), [this, h]() {
+    if (!pcb_->Cancelled()) {
+      h.resume();
+      return;
+    }
+    h.promise().Cancel();
+    h.destroy();
+  });
+}
+
+template <typename T>
+T PromiseAwaiter<T>::await_resume() {
+  return pcb_->Value();
+}
+
+template <typename T>
+PromiseAwaiter<T> operator co_await(const Promise<T> &promise) {
+  return PromiseAwaiter<T>(promise);
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,121 @@
+#include "src/cpp_common/cpppromise/coroutine.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/cpp_common/cpppromise/cpppromise.h"
+
+namespace cpppromise {
+namespace {
+
+// Ask other for two numbers, one at a time, and add them up, recording in
+// which EventQueue each step runs.
+Promise<int> AddRemotely(EventQueue *other, std::vector<EventQueue *> &steps) {
+  steps.push_back(EventQueue::Get());
+  int a = co_await other->Enqueue<int>([]() { return 1; });
+  steps.push_back(EventQueue::Get());
+  int b = co_await other->Enqueue<int>([]() { return 2; });
+  steps.push_back(EventQueue::Get());
+  co_return a + b;
+}
+
+TEST(CoroutineTest, ResumesInTheEventQueueItStartedIn) {
+  EventQueue q;
+  EventQueue other;
+  std::vector<EventQueue *> steps;
+  int result = 0;
+
+  q.Enqueue([&]() {
+    AddRemotely(&other, steps).Then([&result](int k) { result = k; });
+  });
+
+  q.Finish();
+  q.Join();
+  other.Finish();
+  other.Join();
+  EXPECT_EQ(result, 3);
+  EXPECT_EQ(steps, std::vector<EventQueue *>({&q, &q, &q}));
+}
+
+Promise<std::string> Greet(Promise<std::string> name) {
+  std::string s = co_await name;
+  co_return "hello " + s;
+}
+
+TEST(CoroutineTest, ResolvedPromisesDoNotSuspend) {
+  // Not even an EventQueue is needed, since nothing needs to be resumed.
+  Promise<std::string> greeting =
+      Greet(EventQueue::CreateResolvedPromise<std::string>("world"));
+  std::string result;
+
+  EventQueue q;
+  greeting.Then<Empty>(&q, [&result](std::string s) {
+    result = s;
+    return Empty();
+  });
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(result, "hello world");
+}
+
+Promise<Empty> CountDown(EventQueue *other, int n, int &count) {
+  while (n > 0) {
+    co_await other->Enqueue([&n]() { n--; });
+    count++;
+  }
+}
+
+TEST(CoroutineTest, CoroutinesReturningEmpty) {
+  EventQueue q;
+  EventQueue other;
+  int count = 0;
+  bool done = false;
+
+  q.Enqueue([&]() {
+    CountDown(&other, 5, count).Then([&done]() { done = true; });
+  });
+
+  q.Finish();
+  q.Join();
+  other.Finish();
+  other.Join();
+  EXPECT_EQ(count, 5);
+  EXPECT_TRUE(done);
+}
+
+TEST(CoroutineTest, AwaitingAPromiseThatIsResolvedLater) {
+  EventQueue q;
+  auto pr = EventQueue::CreateResolver<std::string>();
+  std::string result;
+
+  q.Enqueue([&]() {
+    Greet(pr.first).Then([&result](std::string s) { result = s; });
+  });
+  pr.second.Resolve("later");
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(result, "hello later");
+}
+
+TEST(CoroutineTest, AwaitingAPromiseThatIsCancelled) {
+  EventQueue q;
+  auto pr = EventQueue::CreateResolver<std::string>();
+  std::optional<std::string> result = "not settled";
+
+  q.Enqueue([&]() {
+    Greet(pr.first).Settled().Then(
+        [&result](std::optional<std::string> s) { result = s; });
+  });
+  pr.second.Cancel();
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(result, std::nullopt);
+}
+
+}  // namespace
+}  // namespace cpppromise
@@ -2,13 +2,21 @@
 
 #pragma once
 
+#include "async_cache.h"
+#include "async_cache_impl.h"
+#include "cancellation_token.h"
 #include "empty.h"
 #include "event_listener.h"
 #include "event_queue.h"
 #include "event_queue_impl.h"
 #include "event_queue_listener.h"
+#include "executor.h"
 #include "lifecycle_listener.h"
 #include "lifecycle_listener_manager.h"
+#include "parallel.h"
+#include "parallel_impl.h"
+#include "pipe.h"
+#include "priority.h"
 #include "process.h"
 #include "process_impl.h"
 #include "promise.h"
@@ -21,3 +29,8 @@
 #include "schedule.h"
 #include "schedule_cancel_trigger.h"
 #include "schedule_control_block.h"
+
+#if defined(__cpp_impl_coroutine)
+#include "coroutine.h"
+#include "coroutine_impl.h"
+#endif
@@ -1,6 +1,15 @@
 #include "src/cpp_common/cpppromise/cpppromise.h"
 
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "customized_test_listeners.h"
 #include "gtest/gtest.h"
@@ -119,6 +128,89 @@ TEST_F(EventQueueTest, ResolveAll) {
   Stop();
 }
 
+TEST_F(EventQueueTest, WhenAll) {
+  std::vector<Resolver<std::string>> resolvers;
+  std::vector<Promise<std::string>> promises;
+  for (int i = 0; i < 3; i++) {
+    auto pr = EventQueue::CreateResolver<std::string>();
+    promises.push_back(pr.first);
+    resolvers.push_back(pr.second);
+  }
+  std::vector<std::string> got;
+  WhenAll(promises).Then<Empty>(q0_.get(), [&got](std::vector<std::string> v) {
+    got = v;
+    return Empty();
+  });
+  // The results keep the order of the Promises, not the order in which they
+  // are resolved.
+  q1_->Enqueue([&]() { resolvers[2].Resolve("c"); });
+  q0_->Enqueue([&]() { resolvers[0].Resolve("a"); });
+  resolvers[1].Resolve("b");
+  Stop();
+  ASSERT_EQ(got, std::vector<std::string>({"a", "b", "c"}));
+}
+
+TEST_F(EventQueueTest, WhenAllOfManyShards) {
+  constexpr int kShards = 10000;
+  std::vector<Promise<int>> shards;
+  for (int i = 0; i < kShards; i++) {
+    EventQueue *q = i % 2 ? q0_.get() : q1_.get();
+    shards.push_back(q->Enqueue<int>([i]() { return i; }));
+  }
+  long sum = -1;
+  WhenAll(std::move(shards))
+      .Then<Empty>(q0_.get(), [&sum](std::vector<int> v) {
+        sum = 0;
+        for (size_t i = 0; i < v.size(); i++) {
+          EXPECT_EQ(v[i], static_cast<int>(i));
+          sum += v[i];
+        }
+        return Empty();
+      });
+  Stop();
+  ASSERT_EQ(sum, static_cast<long>(kShards) * (kShards - 1) / 2);
+}
+
+TEST_F(EventQueueTest, WhenAllOfNothing) {
+  bool resolved = false;
+  WhenAll(std::vector<Promise<int>>())
+      .Then<Empty>(q0_.get(), [&resolved](std::vector<int> v) {
+        resolved = v.empty();
+        return Empty();
+      });
+  Stop();
+  ASSERT_TRUE(resolved);
+}
+
+TEST_F(EventQueueTest, WhenAnyAndWhenN) {
+  std::vector<Resolver<bool>> resolvers;
+  std::vector<Promise<bool>> promises;
+  for (int i = 0; i < 4; i++) {
+    auto pr = EventQueue::CreateResolver<bool>();
+    promises.push_back(pr.first);
+    resolvers.push_back(pr.second);
+  }
+  std::pair<size_t, bool> any;
+  std::vector<std::pair<size_t, bool>> two;
+  WhenAny(promises).Then<Empty>(q0_.get(), [&any](std::pair<size_t, bool> p) {
+    any = p;
+    return Empty();
+  });
+  WhenN(2, promises)
+      .Then<Empty>(q0_.get(), [&two](std::vector<std::pair<size_t, bool>> v) {
+        two = v;
+        return Empty();
+      });
+  resolvers[2].Resolve(true);
+  resolvers[0].Resolve(false);
+  resolvers[3].Resolve(true);
+  resolvers[1].Resolve(false);
+  Stop();
+  ASSERT_EQ(any, std::make_pair(size_t{2}, true));
+  ASSERT_EQ(two, (std::vector<std::pair<size_t, bool>>(
+                     {{size_t{2}, true}, {size_t{0}, false}})));
+}
+
 TEST_F(EventQueueTest, ResolverPromiseOrderOne) {
   const int max = 1024;
   std::vector<int> got;
@@ -174,6 +266,402 @@ TEST_F(EventQueueTest, PromiseCopy) {
   Stop();
 }
 
+TEST_F(EventQueueTest, MoveOnlyValues) {
+  int result = 0;
+  q0_->Enqueue<std::unique_ptr<int>>([]() { return std::make_unique<int>(1); })
+      .Then<std::unique_ptr<int>>(q1_.get(),
+                                  [](std::unique_ptr<int> k) {
+                                    (*k)++;
+                                    return k;
+                                  })
+      .Then<Empty>(q0_.get(), [&result](std::unique_ptr<int> k) {
+        result = *k;
+        return Empty();
+      });
+  Stop();
+  ASSERT_EQ(result, 2);
+}
+
+TEST_F(EventQueueTest, ThenDeducesTheTypeOfItsPromise) {
+  std::string result;
+  Promise<int> a = q0_->Enqueue<int>([]() { return 1; });
+  auto b = a.Then(q1_.get(), [](int k) { return std::to_string(k + 1); });
+  static_assert(std::is_same_v<decltype(b), Promise<std::string>>);
+  auto c = b.Then(q0_.get(), [&result](std::string s) { result = s; });
+  static_assert(std::is_same_v<decltype(c), Promise<Empty>>);
+  Stop();
+  ASSERT_EQ(result, "2");
+}
+
+TEST_F(EventQueueTest, ThenFlattensReturnedPromises) {
+  int result = 0;
+  Promise<int> a = q0_->Enqueue<int>([]() { return 1; });
+  auto b = a.Then(q0_.get(), [this](int k) {
+    return q1_->Enqueue<int>([k]() { return k + 1; });
+  });
+  static_assert(std::is_same_v<decltype(b), Promise<int>>);
+  b.Then(q0_.get(), [&result](int k) { result = k; });
+  Stop();
+  ASSERT_EQ(result, 2);
+}
+
+TEST_F(EventQueueTest, ThenTakesMoveOnlyCallables) {
+  int result = 0;
+  auto p = std::make_unique<int>(40);
+  q0_->Enqueue<int>([]() { return 2; })
+      .Then(q1_.get(), [p = std::move(p)](int k) { return *p + k; })
+      .Then(q0_.get(), [&result](int k) { result = k; });
+  Stop();
+  ASSERT_EQ(result, 42);
+}
+
+TEST_F(EventQueueTest, ThenInlineRunsInTheResolvingThread) {
+  auto pair = EventQueue::CreateResolver<int>();
+  std::thread::id ran_in;
+  std::optional<int> result;
+  pair.first
+      .ThenInline([&ran_in](int k) {
+        ran_in = std::this_thread::get_id();
+        return k * 2;
+      })
+      .Then(q0_.get(), [&result](int k) { result = k; });
+  std::thread resolving([&pair]() { pair.second.Resolve(21); });
+  std::thread::id resolving_id = resolving.get_id();
+  resolving.join();
+  // Once the Promise is resolved, f runs right away.
+  bool ran_now = false;
+  pair.first.ThenInline([&ran_now](int) { ran_now = true; });
+  auto cancelled = EventQueue::CreateResolver<int>();
+  bool skipped = true;
+  cancelled.first.ThenInline([&skipped](int) { skipped = false; });
+  cancelled.second.Cancel();
+  Stop();
+  ASSERT_EQ(ran_in, resolving_id);
+  ASSERT_EQ(result, 42);
+  ASSERT_TRUE(ran_now);
+  ASSERT_TRUE(skipped);
+}
+
+TEST_F(EventQueueTest, LongChainsOfThenInlineDoNotRecurse) {
+  constexpr int kLinks = 100000;
+  auto pair = EventQueue::CreateResolver<int>();
+  Promise<int> p = pair.first;
+  for (int i = 0; i < kLinks; i++) {
+    p = p.ThenInline([](int k) { return k + 1; });
+  }
+  int result = 0;
+  p.Then(q0_.get(), [&result](int k) { result = k; });
+  pair.second.Resolve(0);
+  Stop();
+  ASSERT_EQ(result, kLinks);
+}
+
+TEST_F(EventQueueTest, PipeRunsItsStagesInOneEventQueue) {
+  std::string result;
+  std::vector<EventQueue *> queues;
+  std::vector<EventQueue *> expected = {q1_.get(), q0_.get()};
+  auto record = [&queues]() { queues.push_back(EventQueue::Get()); };
+  auto p = q0_->Enqueue<int>([]() { return 1; })
+               .Then(q1_.get(), Pipe([](int k) { return k + 1; }, record,
+                                     []() { return 2; },
+                                     [](int k) { return std::to_string(k); }));
+  static_assert(std::is_same_v<decltype(p), Promise<std::string>>);
+  p.Then(q0_.get(), Pipe([&result](std::string s) { result = s; }, record));
+  Stop();
+  ASSERT_EQ(result, "2");
+  ASSERT_EQ(queues, expected);
+}
+
+TEST_F(EventQueueTest, PipeCanEndInAnotherEventQueue) {
+  int result = 0;
+  q0_->Enqueue<int>([]() { return 1; })
+      .Then(q0_.get(), Pipe([](int k) { return k * 10; },
+                            [this](int k) {
+                              return q1_->Enqueue<int>(
+                                  [k]() { return k + 1; });
+                            }))
+      .Then(q0_.get(), [&result](int k) { result = k; });
+  Stop();
+  ASSERT_EQ(result, 11);
+}
+
+TEST_F(EventQueueTest, CancelSkipsQueuedTasksAndTheirThens) {
+  std::atomic<bool> go(false);
+  bool ran = false;
+  std::optional<int> result = 0;
+  CancellationToken token;
+  // Hold up q0 until the token is cancelled.
+  q0_->Enqueue([&go]() {
+    while (!go.load()) {
+      std::this_thread::yield();
+    }
+  });
+  q0_->Enqueue<int>(
+         [&ran]() {
+           ran = true;
+           return 1;
+         },
+         token)
+      .Then(q1_.get(), [&ran](int k) {
+        ran = true;
+        return k + 1;
+      })
+      .Settled()
+      .Then(q1_.get(), [&result](std::optional<int> k) { result = k; });
+  token.Cancel();
+  go = true;
+  Stop();
+  ASSERT_FALSE(ran);
+  ASSERT_EQ(result, std::nullopt);
+}
+
+TEST_F(EventQueueTest, CancelSkipsThensOfAPromiseThatIsNeverResolved) {
+  auto pr = EventQueue::CreateResolver<int>();
+  CancellationToken token;
+  bool ran = false;
+  std::optional<int> result = 0;
+  pr.first.WithCancellation(token)
+      .Then(q0_.get(), [&ran](int k) {
+        ran = true;
+        return k;
+      })
+      .Settled()
+      .Then(q1_.get(), [&result](std::optional<int> k) { result = k; });
+  q1_->Enqueue([token]() mutable { token.Cancel(); });
+  // The Then on q0 gives up its lease on q0 once it is cancelled, so q0 can
+  // finish although pr is still around.
+  Stop();
+  ASSERT_FALSE(ran);
+  ASSERT_EQ(result, std::nullopt);
+}
+
+TEST_F(EventQueueTest, CancelSkipsTheRestOfAChain) {
+  CancellationToken token;
+  std::vector<int> stages;
+  std::optional<int> result = 0;
+  q0_->Enqueue<int>([]() { return 0; }, token)
+      .Then(q1_.get(),
+            [&stages, token](int k) mutable {
+              stages.push_back(1);
+              token.Cancel();
+              return k + 1;
+            })
+      .Then(q0_.get(),
+            [&stages](int k) {
+              stages.push_back(2);
+              return k + 1;
+            })
+      .Settled()
+      .Then(q1_.get(), [&result](std::optional<int> k) { result = k; });
+  Stop();
+  ASSERT_EQ(stages, std::vector<int>({1}));
+  ASSERT_EQ(result, std::nullopt);
+}
+
+TEST_F(EventQueueTest, CancellationPropagatesThroughCombinators) {
+  auto a = EventQueue::CreateResolver<int>();
+  auto b = EventQueue::CreateResolver<int>();
+  auto c = EventQueue::CreateResolver<int>();
+  std::optional<std::vector<int>> all = std::vector<int>();
+  std::optional<std::pair<size_t, int>> any;
+  WhenAll(std::vector<Promise<int>>{a.first, b.first})
+      .Settled()
+      .Then(q0_.get(),
+            [&all](std::optional<std::vector<int>> v) { all = v; });
+  // WhenAny only gives up once all of them are cancelled.
+  WhenAny(std::vector<Promise<int>>{b.first, c.first})
+      .Settled()
+      .Then(q0_.get(),
+            [&any](std::optional<std::pair<size_t, int>> v) { any = v; });
+  a.second.Resolve(1);
+  b.second.Cancel();
+  c.second.Resolve(3);
+  Stop();
+  ASSERT_EQ(all, std::nullopt);
+  ASSERT_EQ(any, std::make_optional(std::make_pair(size_t(1), 3)));
+}
+
+TEST_F(EventQueueTest, WithTimeout) {
+  auto never = EventQueue::CreateResolver<int>();
+  std::optional<int> timed_out = 0;
+  std::optional<int> in_time;
+  int fallback = 0;
+  never.first.WithTimeout(std::chrono::milliseconds(1))
+      .Settled()
+      .Then(q0_.get(), [&timed_out](std::optional<int> k) { timed_out = k; });
+  q1_->Enqueue<int>([]() { return 1; })
+      .WithTimeout(std::chrono::hours(1))
+      .Settled()
+      .Then(q0_.get(), [&in_time](std::optional<int> k) { in_time = k; });
+  WithTimeout(never.first, std::chrono::milliseconds(1), -1)
+      .Then(q0_.get(), [&fallback](int k) { fallback = k; });
+  Stop();
+  ASSERT_EQ(timed_out, std::nullopt);
+  ASSERT_EQ(in_time, 1);
+  ASSERT_EQ(fallback, -1);
+}
+
+TEST_F(EventQueueTest, Hedge) {
+  EventQueue backup;
+  HedgeStats stats;
+  std::atomic<bool> stalled{true};
+  std::optional<int> slow;
+  std::optional<int> fast;
+  std::optional<int> failed_over;
+  std::optional<int> failed = 0;
+  // The primary is stuck behind a task that only finishes once the backup has
+  // answered for it.
+  q1_->Enqueue([&stalled]() {
+    while (stalled) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  Hedge<int>(q1_.get(), &backup, []() { return 1; },
+             std::chrono::milliseconds(1), &stats)
+      .Then(q0_.get(), [&slow, &stalled](int k) {
+        slow = k;
+        stalled = false;
+      });
+  Hedge<int>(&backup, q1_.get(), []() { return 2; }, std::chrono::hours(1),
+             &stats)
+      .Then(q0_.get(), [&fast](int k) { fast = k; });
+  auto cancelled = [](CancellationToken) {
+    auto pair = EventQueue::CreateResolver<int>();
+    pair.second.Cancel();
+    return pair.first;
+  };
+  auto resolved = [](CancellationToken) {
+    return EventQueue::CreateResolvedPromise<int>(3);
+  };
+  // A primary that is cancelled hands over to the backup right away.
+  Hedge<int>(cancelled, resolved, std::chrono::hours(1), &stats)
+      .Then(q0_.get(), [&failed_over](int k) { failed_over = k; });
+  Hedge<int>(cancelled, cancelled, std::chrono::hours(1), &stats)
+      .Settled()
+      .Then(q0_.get(), [&failed](std::optional<int> k) { failed = k; });
+  Stop();
+  backup.Finish();
+  backup.Join();
+  ASSERT_EQ(slow, 1);
+  ASSERT_EQ(fast, 2);
+  ASSERT_EQ(failed_over, 3);
+  ASSERT_EQ(failed, std::nullopt);
+  ASSERT_EQ(stats.calls, 4);
+  ASSERT_EQ(stats.hedged, 3);
+  ASSERT_EQ(stats.backup_wins, 2);
+}
+
+// A value that counts how many times it has been copied.
+struct Counted {
+  Counted() = default;
+  Counted(const Counted &) { copies++; }
+  Counted(Counted &&) = default;
+  Counted &operator=(const Counted &) {
+    copies++;
+    return *this;
+  }
+  Counted &operator=(Counted &&) = default;
+
+  static inline std::atomic<int> copies{0};
+};
+
+TEST_F(EventQueueTest, ValuesAreMovedFromHopToHop) {
+  Counted::copies = 0;
+  std::optional<Resolver<Counted>> resolver;
+  {
+    // Once the Promise itself is gone, only the continuations can get at the
+    // value, so nothing needs to be copied.
+    auto pr = EventQueue::CreateResolver<Counted>();
+    resolver = pr.second;
+    pr.first.Then<Counted>(q0_.get(), [](Counted c) { return c; })
+        .Then<Counted>(q1_.get(), [](Counted c) { return c; })
+        .Then<Empty>(q0_.get(), [](Counted c) { return Empty(); });
+  }
+  resolver->Resolve(Counted());
+  Stop();
+  ASSERT_EQ(Counted::copies.load(), 0);
+}
+
+TEST_F(EventQueueTest, ValuesAreCopiedWhilePromisesRemain) {
+  Counted::copies = 0;
+  auto pr = EventQueue::CreateResolver<Counted>();
+  pr.first.Then<Empty>(q0_.get(), [](Counted c) { return Empty(); });
+  pr.second.Resolve(Counted());
+  // pr.first could still be used to add another continuation, so the one
+  // there is gets a copy.
+  pr.first.Then<Empty>(q0_.get(), [](Counted c) { return Empty(); });
+  Stop();
+  ASSERT_EQ(Counted::copies.load(), 2);
+}
+
+TEST_F(EventQueueTest, ThenOnAResolvedPromiseGetsACopy) {
+  Promise<std::string> p =
+      EventQueue::CreateResolvedPromise<std::string>("hello");
+  std::vector<std::string> got;
+  // Nothing but p holds on to the result here, but p may be used again.
+  for (int i = 0; i < 2; i++) {
+    p.Then<Empty>(q0_.get(), [&got](std::string s) {
+      got.push_back(s);
+      return Empty();
+    });
+  }
+  Stop();
+  ASSERT_EQ(got, std::vector<std::string>({"hello", "hello"}));
+}
+
+TEST_F(EventQueueTest, ThenRacingWithResolve) {
+  constexpr int kThreads = 4;
+  constexpr int kThens = 200;
+  auto pr = EventQueue::CreateResolver<int>();
+  // Only touched in q0_.
+  std::vector<std::vector<int>> got(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kThens; i++) {
+        pr.first.Then<Empty>(q0_.get(), [&got, t, i](int k) {
+          got[t].push_back(i + k);
+          return Empty();
+        });
+      }
+    });
+  }
+  pr.second.Resolve(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  Stop();
+  // Each thread's continuations run in the order it added them, whether they
+  // were added before or after the Promise was resolved.
+  std::vector<int> want;
+  for (int i = 0; i < kThens; i++) {
+    want.push_back(i);
+  }
+  for (int t = 0; t < kThreads; t++) {
+    ASSERT_EQ(got[t], want);
+  }
+}
+
+TEST_F(EventQueueTest, SharedResultsAreNotCopied) {
+  Counted::copies = 0;
+  auto pr = EventQueue::CreateResolver<Counted>();
+  Promise<std::shared_ptr<const Counted>> shared = pr.first.Share();
+  std::mutex mu;
+  std::set<const Counted *> seen;
+  for (int i = 0; i < 10; i++) {
+    shared.Then<Empty>(i % 2 ? q0_.get() : q1_.get(),
+                       [&](std::shared_ptr<const Counted> c) {
+                         std::unique_lock<std::mutex> lock(mu);
+                         seen.insert(c.get());
+                         return Empty();
+                       });
+  }
+  pr.second.Resolve(Counted());
+  Stop();
+  ASSERT_EQ(Counted::copies.load(), 0);
+  ASSERT_EQ(seen.size(), 1);
+}
+
 TEST_F(EventQueueTest, EnqueueWithResolver) {
   cpppromise::Promise<int> p = q0_->EnqueueWithResolver<int>(
       [](cpppromise::Resolver<int> resolver) { resolver.Resolve(42); });
@@ -0,0 +1,47 @@
+#include "event_count.h"
+
+namespace cpppromise {
+
+uint64_t EventCount::PrepareWait() {
+  uint64_t state = state_.fetch_add(kWaiter, std::memory_order_relaxed);
+  // Pairs with the fence in Notify: either the notifier sees us waiting, or we
+  // see the condition it made true when we check it again.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return state >> 32;
+}
+
+void EventCount::CancelWait() {
+  state_.fetch_sub(kWaiter, std::memory_order_relaxed);
+}
+
+void EventCount::Wait(uint64_t key) {
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    while ((state_.load(std::memory_order_acquire) >> 32) == key) {
+      cond_.wait(lock);
+    }
+  }
+  state_.fetch_sub(kWaiter, std::memory_order_relaxed);
+}
+
+void EventCount::Notify() { Wake(true); }
+
+void EventCount::NotifyOne() { Wake(false); }
+
+void EventCount::Wake(bool all) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if ((state_.load(std::memory_order_relaxed) & kWaiterMask) == 0) {
+    return;
+  }
+  state_.fetch_add(kEpoch, std::memory_order_release);
+  // Taking the lock makes sure that a waiter that saw the old epoch is now
+  // inside cond_.wait, where the notify will reach it.
+  std::unique_lock<std::mutex> lock(mu_);
+  if (all) {
+    cond_.notify_all();
+  } else {
+    cond_.notify_one();
+  }
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace cpppromise {
+
+// An EventCount lets a thread sleep until some condition, checked without a
+// lock, becomes true, while letting the threads that make the condition true
+// skip the wakeup entirely when nobody is asleep. A waiter does:
+//
+//   if (!condition()) {
+//     uint64_t key = ec.PrepareWait();
+//     if (condition()) {
+//       ec.CancelWait();
+//     } else {
+//       ec.Wait(key);
+//     }
+//   }
+//
+// and a notifier makes condition() true, then calls Notify, or NotifyOne when
+// one woken waiter is enough to deal with what changed.
+class EventCount {
+ public:
+  EventCount() : state_(0) {}
+
+  EventCount(const EventCount &) = delete;
+  EventCount &operator=(const EventCount &) = delete;
+
+  // Announce that the caller intends to wait. The caller must then check its
+  // condition once more and call either CancelWait or Wait.
+  uint64_t PrepareWait();
+
+  // Withdraw the intention announced by PrepareWait.
+  void CancelWait();
+
+  // Block until Notify has been called since the PrepareWait that returned
+  // key.
+  void Wait(uint64_t key);
+
+  // Wake up all waiters. Costs no more than a fence when there are none.
+  void Notify();
+
+  // Like Notify, but wakes up only one of the waiters blocked in Wait. Waiters
+  // that have not yet blocked may also return, since the epoch still advances.
+  void NotifyOne();
+
+ private:
+  // The low half of state_ counts waiters; the high half is an epoch that
+  // every Notify with waiters advances.
+  static constexpr uint64_t kWaiter = 1;
+  static constexpr uint64_t kEpoch = uint64_t(1) << 32;
+  static constexpr uint64_t kWaiterMask = kEpoch - 1;
+
+  void Wake(bool all);
+
+  std::atomic<uint64_t> state_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+};
+
+}  // namespace cpppromise
@@ -1,11 +1,19 @@
 #include "event_queue.h"
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
 #include "event_queue_impl.h"
+#include "executor.h"
+#include "free_list_pool.h"
 #include "lifecycle_listener_manager.h"
+#include "mpsc_queue_impl.h"
 #include "promise.h"
 #include "promise_control_block.h"
 #include "promise_control_block_impl.h"
 #include "promise_impl.h"
+#include "reactor.h"
 #include "resolver.h"
 #include "resolver_impl.h"
 #include "schedule.h"
@@ -19,7 +27,78 @@ namespace cpppromise {
 // always have to supply it with every function call.
 inline thread_local EventQueue *__thread_q__ = nullptr;
 
-EventQueue::EventQueue(std::string id) : running_(true), count_(0) {
+// The memory of deleted Tasks is recycled through a FreeListPool.
+void *EventQueue::Task::operator new(std::size_t size) {
+  assert(size == sizeof(Task));
+  return FreeListPool<sizeof(Task)>::Allocate();
+}
+
+void EventQueue::Task::operator delete(void *p) {
+  FreeListPool<sizeof(Task)>::Free(p);
+}
+
+namespace {
+
+// The most tasks an EventQueue runs in a row on an executor worker, before it
+// lets the worker run other EventQueues.
+constexpr int kStrandBatch = 64;
+
+// The most tasks an EventQueue runs in a row from its local lanes, before it
+// lets a task from another thread in.
+constexpr int kLocalBatch = 64;
+
+void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Spinning only helps if some other CPU can produce work in the meantime.
+EventQueue::Options InitialDefaultOptions() {
+  EventQueue::Options options;
+  if (std::thread::hardware_concurrency() > 1) {
+    options.max_spin = std::chrono::microseconds(20);
+  }
+  return options;
+}
+
+std::mutex default_options_mu;
+EventQueue::Options default_options = InitialDefaultOptions();
+
+}  // namespace
+
+EventQueue::Options EventQueue::GetDefaultOptions() {
+  std::unique_lock<std::mutex> lock(default_options_mu);
+  return default_options;
+}
+
+void EventQueue::SetDefaultOptions(Options options) {
+  std::unique_lock<std::mutex> lock(default_options_mu);
+  default_options = options;
+}
+
+EventQueue::EventQueue(std::string id)
+    : EventQueue(std::move(id), GetDefaultOptions()) {}
+
+EventQueue::EventQueue(std::string id, Options options)
+    : done_(false),
+      notifications_(0),
+      local_run_(0),
+      passed_over_(),
+      depth_(0),
+      drops_owed_(0),
+      dropped_(0),
+      running_(true),
+      count_(0),
+      releasing_(0),
+      options_(options),
+      spin_(options.max_spin) {
+  assert(!options_.reactor || !options_.executor);
+  if (options_.reactor) {
+    reactor_ = std::make_unique<Reactor>();
+  }
   if (LifecycleListenerManager::Get()) {
     eq_listener_ = LifecycleListenerManager::Get()->OnEventQueueCreated(id);
   }
@@ -32,90 +111,521 @@ EventQueue::~EventQueue() {
   assert(Get() != this);
   Finish();
   Join();
+  while (releasing_.load() > 0) {
+    std::this_thread::yield();
+  }
+  for (int i = 0; i < kNumPriorities; i++) {
+    while (Task *task = PopLane(i)) {
+      delete task;
+    }
+  }
+  // Dropping the callbacks of file descriptors that never became ready may
+  // release leases on this EventQueue, which must not reach the reactor while
+  // it is being destroyed.
+  std::unique_ptr<Reactor> reactor = std::move(reactor_);
+}
+
+int EventQueue::Depth() const { return depth_.load(); }
+
+long EventQueue::Dropped() const { return dropped_.load(); }
+
+bool EventQueue::TryReserve() {
+  int depth = depth_.load();
+  while (depth < options_.capacity) {
+    if (depth_.compare_exchange_weak(depth, depth + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool EventQueue::Reserve(OverflowPolicy policy) {
+  if (options_.capacity == 0) {
+    depth_.fetch_add(1);
+    return true;
+  }
+  switch (policy) {
+    case OverflowPolicy::kBlock:
+      if (Get() != nullptr) {
+        // Blocking one EventQueue on another could deadlock.
+        depth_.fetch_add(1);
+        return true;
+      }
+      while (!TryReserve()) {
+        uint64_t key = space_.PrepareWait();
+        if (TryReserve()) {
+          space_.CancelWait();
+          break;
+        }
+        space_.Wait(key);
+      }
+      return true;
+    case OverflowPolicy::kReject:
+      if (TryReserve()) {
+        return true;
+      }
+      dropped_.fetch_add(1);
+      return false;
+    case OverflowPolicy::kDropOldest:
+      if (depth_.fetch_add(1) >= options_.capacity) {
+        // Only the worker can pop tasks, so leave the dropping to it.
+        drops_owed_.fetch_add(1);
+      }
+      return true;
+  }
+  return true;
 }
 
-void EventQueue::AddTask(const std::function<void()> &f, std::string id) {
-  std::unique_lock<std::mutex> lock(mu_);
+void EventQueue::AddTask(TaskFunction f, std::string id, Priority priority) {
+  if (Reserve(options_.overflow_policy)) {
+    PushTask(std::move(f), std::move(id), priority);
+  }
+}
+
+void EventQueue::AddTasks(std::vector<TaskFunction> fs, const std::string &id,
+                          Priority priority) {
+  if (options_.capacity == 0) {
+    depth_.fetch_add(fs.size());
+    PushTasks(fs, id, priority);
+    return;
+  }
+  std::vector<TaskFunction> accepted;
+  for (TaskFunction &f : fs) {
+    bool reserved = TryReserve();
+    if (!reserved) {
+      // Under kBlock, the worker cannot make room while we hold on to tasks it
+      // has not seen yet, so hand those over first.
+      PushTasks(accepted, id, priority);
+      accepted.clear();
+      reserved = Reserve(options_.overflow_policy);
+    }
+    if (reserved) {
+      accepted.push_back(std::move(f));
+    }
+  }
+  PushTasks(accepted, id, priority);
+}
+
+EventQueue::Task *EventQueue::NewTask(TaskFunction f, std::string id) {
   std::shared_ptr<EventListener> e_listener;
   if (eq_listener_) {
+    // Listeners are not required to be thread safe, so serialize them.
+    std::unique_lock<std::mutex> lock(mu_);
     e_listener = eq_listener_->OnEventEnqueued(id);
+    if (e_listener) {
+      e_listener->OnEnqueued();
+    }
+  }
+  return new Task{{}, std::move(id), std::move(e_listener), std::move(f)};
+}
+
+void EventQueue::PushTask(TaskFunction f, std::string id, Priority priority) {
+  Task *task = NewTask(std::move(f), std::move(id));
+  if (Get() == this) {
+    // The worker is adding a task to itself, typically a continuation of a
+    // Promise it just resolved. There is no need to synchronize with anyone,
+    // nor to wake anyone up: the worker picks it up once the current task is
+    // done.
+    local_tasks_[static_cast<int>(priority)].Push(task);
+    return;
+  }
+  tasks_[static_cast<int>(priority)].Push(task);
+  Notify();
+}
+
+void EventQueue::PushTasks(std::vector<TaskFunction> &fs,
+                           const std::string &id, Priority priority) {
+  if (fs.empty()) {
+    return;
+  }
+  int lane = static_cast<int>(priority);
+  if (Get() == this) {
+    for (TaskFunction &f : fs) {
+      local_tasks_[lane].Push(NewTask(std::move(f), id));
+    }
+    return;
+  }
+  // Link the tasks up first, so that they go onto the lane with one exchange.
+  Task *first = nullptr;
+  Task *last = nullptr;
+  for (TaskFunction &f : fs) {
+    Task *task = NewTask(std::move(f), id);
+    if (last == nullptr) {
+      first = task;
+    } else {
+      last->next.store(task, std::memory_order_relaxed);
+    }
+    last = task;
+  }
+  tasks_[lane].PushChain(first, last);
+  Notify();
+}
+
+void EventQueue::LocalLane::Push(Task *task) {
+  task->next.store(nullptr, std::memory_order_relaxed);
+  if (tail_ == nullptr) {
+    head_ = task;
+  } else {
+    tail_->next.store(task, std::memory_order_relaxed);
+  }
+  tail_ = task;
+}
+
+EventQueue::Task *EventQueue::LocalLane::Pop() {
+  Task *task = head_;
+  if (task != nullptr) {
+    head_ = static_cast<Task *>(task->next.load(std::memory_order_relaxed));
+    if (head_ == nullptr) {
+      tail_ = nullptr;
+    }
   }
-  if (e_listener) {
-    e_listener->OnEnqueued();
+  return task;
+}
+
+void EventQueue::Notify() {
+  if (reactor_) {
+    reactor_->Notify();
+  } else if (!options_.executor) {
+    idle_.Notify();
+  } else if (notifications_.fetch_add(1) == 0) {
+    options_.executor->Submit([this]() { RunStrand(); });
   }
-  Task task = {id, e_listener, f};
-  tasks_.push_back(task);
-  cond_.notify_one();
+}
+
+void EventQueue::RunStrand() {
+  // Every notification counted so far comes after a change that we are about
+  // to see.
+  int seen = notifications_.load();
+  EventQueue *outer = __thread_q__;
+  __thread_q__ = this;
+  Drain(kStrandBatch);
+  __thread_q__ = outer;
+  if (!TasksEmpty()) {
+    // Let other EventQueues have a turn before running the next batch.
+    options_.executor->Submit([this]() { RunStrand(); });
+    return;
+  }
+  if (!running_.load() && count_.load() == 0) {
+    // Leave notifications_ non-zero, so that this is the last run.
+    std::unique_lock<std::mutex> lock(join_mu_);
+    done_ = true;
+    done_cond_.notify_all();
+    return;
+  }
+  if (notifications_.fetch_sub(seen) != seen) {
+    // Someone made another change since we looked, and left it to us.
+    options_.executor->Submit([this]() { RunStrand(); });
+  }
+  // Otherwise, we must not touch the EventQueue any more: the next Notify may
+  // run it elsewhere, and it may have been destroyed by the time we get here.
 }
 
 void EventQueue::Start() {
+  if (options_.executor) {
+    // There is no thread to start. RunStrand is scheduled when there is work.
+    return;
+  }
   t_ = std::thread([this]() {
     __thread_q__ = this;
     while (true) {
-      Task task;
-      {
-        std::unique_lock<std::mutex> lock(mu_);
-        if (tasks_.empty()) {
-          if (!running_ && count_ == 0) {
-            break;
-          } else {
-            cond_.wait(lock);
-            continue;
-          }
-        }
-        task = tasks_.front();
-        tasks_.pop_front();
-        if (task.e_listener) {
-          task.e_listener->OnDequeued();
-        }
-        if (eq_listener_) {
-          eq_listener_->OnEventDequeued(task.id);
+      if (Drain(std::numeric_limits<int>::max()) > 0 || Spin()) {
+        if (reactor_) {
+          // Do not let a steady stream of tasks hold up I/O.
+          reactor_->Poll();
         }
+        continue;
+      }
+      uint64_t key = PrepareSleep();
+      if (!TasksEmpty()) {
+        // Either more work arrived, or a Push is half done. Go around again.
+        CancelSleep();
+        continue;
       }
-      if (task.e_listener) {
-        task.e_listener->OnStarted();
+      if (!running_.load() && count_.load() == 0) {
+        CancelSleep();
+        break;
       }
-      task.f();
-      if (task.e_listener) {
-        task.e_listener->OnCompleted();
+      auto start = std::chrono::steady_clock::now();
+      Sleep(key);
+      if (std::chrono::steady_clock::now() - start < options_.max_spin) {
+        // We would not have had to sleep if we had spun for longer.
+        spin_ = std::min(options_.max_spin,
+                         std::max(2 * spin_, std::chrono::nanoseconds(1000)));
       }
     }
     __thread_q__ = nullptr;
   });
 }
 
+bool EventQueue::Spin() {
+  if (spin_.count() == 0) {
+    return false;
+  }
+  auto deadline = std::chrono::steady_clock::now() + spin_;
+  while (true) {
+    for (int i = 0; i < 64; i++) {
+      if (!TasksEmpty()) {
+        return true;
+      }
+      CpuRelax();
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      // Spinning did not pay off this time, so do less of it next time.
+      spin_ /= 2;
+      return false;
+    }
+  }
+}
+
+uint64_t EventQueue::PrepareSleep() {
+  if (reactor_) {
+    reactor_->PrepareWait();
+    return 0;
+  }
+  return idle_.PrepareWait();
+}
+
+void EventQueue::CancelSleep() {
+  if (reactor_) {
+    reactor_->CancelWait();
+  } else {
+    idle_.CancelWait();
+  }
+}
+
+void EventQueue::Sleep(uint64_t key) {
+  if (reactor_) {
+    reactor_->Wait();
+  } else {
+    idle_.Wait(key);
+  }
+}
+
+bool EventQueue::LaneEmpty(int i) const {
+  return local_tasks_[i].Empty() && tasks_[i].Empty();
+}
+
+bool EventQueue::TasksEmpty() const {
+  for (int i = 0; i < kNumPriorities; i++) {
+    if (!LaneEmpty(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+EventQueue::Task *EventQueue::PopLane(int i) {
+  // Local tasks are the cheapest to get at, and are usually continuations of
+  // the task that just ran, so they go first. But other threads get a turn
+  // every so often.
+  if (!local_tasks_[i].Empty() && local_run_ < kLocalBatch) {
+    local_run_++;
+    return local_tasks_[i].Pop();
+  }
+  if (Task *task = tasks_[i].Pop()) {
+    local_run_ = 0;
+    return task;
+  }
+  return local_tasks_[i].Pop();
+}
+
+EventQueue::Task *EventQueue::PopTask() {
+  // A lane that has waited long enough goes first, lowest priority first.
+  if (options_.starvation_limit > 0) {
+    for (int i = kNumPriorities - 1; i > 0; i--) {
+      if (passed_over_[i] >= options_.starvation_limit) {
+        if (Task *task = PopLane(i)) {
+          passed_over_[i] = 0;
+          return task;
+        }
+      }
+    }
+  }
+  for (int i = 0; i < kNumPriorities; i++) {
+    if (Task *task = PopLane(i)) {
+      passed_over_[i] = 0;
+      for (int j = i + 1; j < kNumPriorities; j++) {
+        if (!LaneEmpty(j)) {
+          passed_over_[j]++;
+        }
+      }
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void EventQueue::DropOldest() {
+  while (drops_owed_.load() > 0) {
+    drops_owed_.fetch_sub(1);
+    if (depth_.load() <= options_.capacity) {
+      // We caught up in the meantime, so there is no need to drop anything.
+      continue;
+    }
+    Task *task = nullptr;
+    for (int i = kNumPriorities - 1; i >= 0 && task == nullptr; i--) {
+      task = PopLane(i);
+    }
+    if (task == nullptr) {
+      // A Push is half done. Try again next time around.
+      drops_owed_.fetch_add(1);
+      return;
+    }
+    depth_.fetch_sub(1);
+    dropped_.fetch_add(1);
+    OnDequeued(*task);
+    delete task;
+  }
+}
+
+int EventQueue::Drain(int max_tasks) {
+  int ran = 0;
+  while (ran < max_tasks) {
+    if (drops_owed_.load(std::memory_order_relaxed) > 0) {
+      DropOldest();
+    }
+    Task *task = PopTask();
+    if (task == nullptr) {
+      break;
+    }
+    depth_.fetch_sub(1);
+    if (options_.capacity > 0 &&
+        options_.overflow_policy == OverflowPolicy::kBlock) {
+      space_.Notify();
+    }
+    RunTask(std::unique_ptr<Task>(task));
+    ran++;
+  }
+  return ran;
+}
+
+void EventQueue::OnDequeued(Task &task) {
+  if (eq_listener_) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (task.e_listener) {
+      task.e_listener->OnDequeued();
+    }
+    eq_listener_->OnEventDequeued(task.id);
+  }
+}
+
+void EventQueue::RunTask(std::unique_ptr<Task> task) {
+  OnDequeued(*task);
+  if (task->e_listener) {
+    task->e_listener->OnStarted();
+  }
+  task->f();
+  if (task->e_listener) {
+    task->e_listener->OnCompleted();
+  }
+}
+
 void EventQueue::Join() {
   std::unique_lock<std::mutex> lock(join_mu_);
-  if (t_.joinable()) {
+  if (options_.executor) {
+    done_cond_.wait(lock, [this]() { return done_; });
+  } else if (t_.joinable()) {
     t_.join();
   }
 }
 
 void EventQueue::Finish() {
-  std::unique_lock<std::mutex> lock(mu_);
-  running_ = false;
-  cond_.notify_one();
+  running_.store(false);
+  Notify();
 }
 
 Promise<Empty> EventQueue::Enqueue(std::function<void(void)> f,
-                                   std::string id) {
-  return Enqueue<Empty>(
-      [f]() {
+                                   std::string id, Priority priority) {
+  auto pcb = PromiseControlBlock<Empty>::Create(id);
+  AddTask(
+      [f = std::move(f), result = PendingResult<Empty>(pcb)]() mutable {
         f();
-        return Empty{};
+        result.Take()->Resolve(Empty{});
+      },
+      std::move(id), priority);
+  return Promise<Empty>(pcb);
+}
+
+Promise<Empty> EventQueue::Enqueue(std::function<void()> f,
+                                   CancellationToken token, std::string id,
+                                   Priority priority) {
+  auto pcb = PromiseControlBlock<Empty>::Create(id, std::move(token));
+  AddTask(
+      [f = std::move(f), result = PendingResult<Empty>(pcb)]() mutable {
+        std::shared_ptr<PromiseControlBlock<Empty>> pcb = result.Take();
+        if (!pcb->CancelIfRequested()) {
+          f();
+          pcb->Resolve(Empty{});
+        }
       },
-      id);
+      std::move(id), priority);
+  return Promise<Empty>(pcb);
 }
 
-void EventQueue::Take() {
-  std::unique_lock<std::mutex> lock(mu_);
-  count_++;
+std::optional<Promise<Empty>> EventQueue::TryEnqueue(std::function<void()> f,
+                                                     std::string id,
+                                                     Priority priority) {
+  if (!Reserve(OverflowPolicy::kReject)) {
+    return std::nullopt;
+  }
+  auto pcb = PromiseControlBlock<Empty>::Create(id);
+  PushTask(
+      [f = std::move(f), result = PendingResult<Empty>(pcb)]() mutable {
+        f();
+        result.Take()->Resolve(Empty{});
+      },
+      std::move(id), priority);
+  return Promise<Empty>(pcb);
 }
 
+std::vector<Promise<Empty>> EventQueue::EnqueueBatch(
+    std::vector<std::function<void()>> fs, std::string id, Priority priority) {
+  std::vector<Promise<Empty>> promises;
+  std::vector<TaskFunction> tasks;
+  promises.reserve(fs.size());
+  tasks.reserve(fs.size());
+  for (auto &f : fs) {
+    auto pcb = PromiseControlBlock<Empty>::Create(id);
+    tasks.push_back(
+        [f = std::move(f), result = PendingResult<Empty>(pcb)]() mutable {
+          f();
+          result.Take()->Resolve(Empty{});
+        });
+    promises.push_back(Promise<Empty>(pcb));
+  }
+  AddTasks(std::move(tasks), id, priority);
+  return promises;
+}
+
+Promise<Empty> EventQueue::WhenReadable(int fd, std::string id) {
+  assert(reactor_);
+  auto pair = CreateResolver<Empty>(std::move(id));
+  reactor_->WhenReadable(fd, [resolver = std::move(pair.second)]() mutable {
+    resolver.Resolve(Empty{});
+  });
+  return pair.first;
+}
+
+Promise<Empty> EventQueue::WhenWritable(int fd, std::string id) {
+  assert(reactor_);
+  auto pair = CreateResolver<Empty>(std::move(id));
+  reactor_->WhenWritable(fd, [resolver = std::move(pair.second)]() mutable {
+    resolver.Resolve(Empty{});
+  });
+  return pair.first;
+}
+
+void EventQueue::Take() { count_.fetch_add(1); }
+
 void EventQueue::Release() {
-  std::unique_lock<std::mutex> lock(mu_);
-  count_--;
-  cond_.notify_one();
+  // The worker only needs to hear about the last lease going away, and only
+  // once it has been told to Finish. If Finish comes later, it notifies the
+  // worker itself.
+  releasing_.fetch_add(1);
+  if (count_.fetch_sub(1) == 1 && !running_.load()) {
+    Notify();
+  }
+  releasing_.fetch_sub(1);
 }
 
 Schedule EventQueue::DoPeriodically(std::function<Promise<bool>()> f,
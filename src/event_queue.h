@@ -1,14 +1,25 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
-#include <deque>
+#include <cstddef>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "cancellation_token.h"
 #include "empty.h"
+#include "event_count.h"
 #include "event_queue_listener.h"
+#include "mpsc_queue.h"
+#include "priority.h"
+#include "task_function.h"
 #include "timer.h"
 
 namespace cpppromise {
@@ -19,12 +30,63 @@ class Promise;
 template <typename T>
 class Resolver;
 
+class Executor;
+
+class Reactor;
+
 class Schedule;
 
 class EventQueue {
  public:
+  // What an EventQueue that is at capacity does with another task.
+  enum class OverflowPolicy {
+    // Block the caller until there is room, unless it is running in an
+    // EventQueue itself, in which case the task is accepted anyway, to avoid
+    // deadlocks.
+    kBlock,
+    // Refuse the task. Its Promise is cancelled.
+    kReject,
+    // Accept the task, and drop the oldest task from the lowest priority lane
+    // that has any instead. The dropped task's Promise is cancelled.
+    kDropOldest,
+  };
+
+  struct Options {
+    // The longest time an idle worker spins, waiting for new tasks, before it
+    // goes to sleep. Spinning makes the EventQueue quicker to respond to new
+    // work, at the cost of CPU time. The worker adapts how long it actually
+    // spins to how often spinning pays off.
+    std::chrono::nanoseconds max_spin{0};
+
+    // If set, the EventQueue does not get a thread of its own. Its tasks are
+    // run on the Executor's worker threads instead, still one at a time and in
+    // the order they were enqueued. The Executor must outlive the EventQueue,
+    // and must not be blocked waiting for it, e.g. by a Join from one of its
+    // workers.
+    Executor *executor = nullptr;
+
+    // How many times in a row a lane with tasks waiting can be passed over in
+    // favor of higher priority lanes before it gets a turn anyway. Zero means
+    // that lanes are always served in strict priority order.
+    int starvation_limit = 16;
+
+    // The most tasks the EventQueue holds at once, or zero for no limit. Tasks
+    // added after that are subject to the overflow_policy.
+    int capacity = 0;
+
+    OverflowPolicy overflow_policy = OverflowPolicy::kBlock;
+
+    // If set, the worker sleeps in epoll instead of on a condition variable,
+    // so that it can wait for file descriptors with WhenReadable and
+    // WhenWritable as well as for tasks. Only on Linux, and not together with
+    // an executor.
+    bool reactor = false;
+  };
+
   EventQueue(std::string id = "");
 
+  EventQueue(std::string id, Options options);
+
   ~EventQueue();
 
   void Join();
@@ -33,6 +95,13 @@ class EventQueue {
 
   static EventQueue *Get();
 
+  // The Options used by EventQueues constructed without any, and so by every
+  // Process. By default, idle workers spin for a short while if there is more
+  // than one CPU.
+  static Options GetDefaultOptions();
+
+  static void SetDefaultOptions(Options options);
+
   template <typename T>
   static std::pair<Promise<T>, Resolver<T>> CreateResolver(std::string id = "");
 
@@ -40,13 +109,69 @@ class EventQueue {
   static Promise<T> CreateResolvedPromise(T val, std::string id = "");
 
   template <typename T>
-  Promise<T> Enqueue(std::function<T()> f, std::string id = "");
+  Promise<T> Enqueue(std::function<T()> f, std::string id = "",
+                     Priority priority = Priority::kNormal);
 
-  Promise<Empty> Enqueue(std::function<void()> f, std::string id = "");
+  Promise<Empty> Enqueue(std::function<void()> f, std::string id = "",
+                         Priority priority = Priority::kNormal);
+
+  // Like Enqueue, but if token is cancelled before the task starts, it is
+  // skipped, and its Promise is cancelled. So are the continuations added to
+  // that Promise, and theirs. See CancellationToken.
+  template <typename T>
+  Promise<T> Enqueue(std::function<T()> f, CancellationToken token,
+                     std::string id = "",
+                     Priority priority = Priority::kNormal);
+
+  Promise<Empty> Enqueue(std::function<void()> f, CancellationToken token,
+                         std::string id = "",
+                         Priority priority = Priority::kNormal);
+
+  // Like Enqueue, but if the EventQueue is at capacity, return std::nullopt
+  // instead of applying its overflow_policy.
+  template <typename T>
+  std::optional<Promise<T>> TryEnqueue(std::function<T()> f,
+                                       std::string id = "",
+                                       Priority priority = Priority::kNormal);
+
+  std::optional<Promise<Empty>> TryEnqueue(
+      std::function<void()> f, std::string id = "",
+      Priority priority = Priority::kNormal);
+
+  // Like calling Enqueue with each function in turn, but the tasks are handed
+  // to the worker all at once, and it is woken up only once. Each task still
+  // gets its own Promise and its own lifecycle listener events.
+  template <typename T>
+  std::vector<Promise<T>> EnqueueBatch(std::vector<std::function<T()>> fs,
+                                       std::string id = "",
+                                       Priority priority = Priority::kNormal);
+
+  std::vector<Promise<Empty>> EnqueueBatch(
+      std::vector<std::function<void()>> fs, std::string id = "",
+      Priority priority = Priority::kNormal);
 
   template <typename T>
   Promise<T> EnqueueWithResolver(std::function<void(Resolver<T>)> resolve,
-                                 std::string id = "");
+                                 std::string id = "",
+                                 Priority priority = Priority::kNormal);
+
+  // The number of tasks waiting to run. Producers can use this to slow down
+  // before they hit the capacity.
+  int Depth() const;
+
+  // The number of tasks that were refused or dropped because the EventQueue
+  // was at capacity.
+  long Dropped() const;
+
+  // Return a Promise that is resolved by the worker once fd is readable, or
+  // has hung up or failed. fd must be non-blocking, and must stay open until
+  // then. Requires Options::reactor. The Promise does not keep the EventQueue
+  // from finishing, but continuations on this EventQueue do, as with any other
+  // Promise.
+  Promise<Empty> WhenReadable(int fd, std::string id = "");
+
+  // Like WhenReadable, but for fd becoming writable.
+  Promise<Empty> WhenWritable(int fd, std::string id = "");
 
   Schedule DoPeriodically(std::function<bool()> f,
                           std::chrono::nanoseconds interval,
@@ -56,10 +181,15 @@ class EventQueue {
                           std::chrono::nanoseconds interval,
                           std::string id = "");
 
-  struct Task {
+  struct Task : public MpscNode {
     std::string id;
     std::shared_ptr<EventListener> e_listener;
-    std::function<void()> f;
+    TaskFunction f;
+
+    // Tasks are recycled through free lists instead of going back to the heap,
+    // so that a busy EventQueue does not allocate for each one.
+    static void *operator new(std::size_t size);
+    static void operator delete(void *p);
   };
 
  private:
@@ -67,18 +197,110 @@ class EventQueue {
   friend class PromiseControlBlock;
   friend class ScheduleControlBlock;
 
+  // A FIFO of the tasks that the EventQueue added to itself, from its own
+  // tasks. Only the worker touches it, so it needs no synchronization.
+  class LocalLane {
+   public:
+    bool Empty() const { return head_ == nullptr; }
+    void Push(Task *task);
+    Task *Pop();
+
+   private:
+    Task *head_ = nullptr;
+    Task *tail_ = nullptr;
+  };
+
   void Start();
-  void AddTask(const std::function<void()> &f, std::string id);
+  // Run every task that is ready, without stopping to sleep or to check for
+  // shutdown in between, up to max_tasks of them. Return the number of tasks
+  // run.
+  int Drain(int max_tasks);
+  // Pop the next task to run from the lanes, or return nullptr if there is
+  // none.
+  Task *PopTask();
+  // Pop the next task from lane i, local or not.
+  Task *PopLane(int i);
+  bool LaneEmpty(int i) const;
+  // Whether all the lanes are empty. Only for use by the worker.
+  bool TasksEmpty() const;
+  // Drop the oldest tasks from the lowest lanes, as many as are owed under
+  // OverflowPolicy::kDropOldest.
+  void DropOldest();
+  void OnDequeued(Task &task);
+  void RunTask(std::unique_ptr<Task> task);
+  // Make room for one more task under the given policy. Return false if the
+  // task must be refused.
+  bool Reserve(OverflowPolicy policy);
+  // Take room for one more task if that is within capacity.
+  bool TryReserve();
+  // Create a task, and tell the lifecycle listeners about it.
+  Task *NewTask(TaskFunction f, std::string id);
+  // Add a task that there is room for.
+  void PushTask(TaskFunction f, std::string id, Priority priority);
+  void AddTask(TaskFunction f, std::string id, Priority priority);
+  // Add tasks that there is room for, all at once.
+  void PushTasks(std::vector<TaskFunction> &fs, const std::string &id,
+                 Priority priority);
+  // Like AddTask, for many tasks.
+  void AddTasks(std::vector<TaskFunction> fs, const std::string &id,
+                Priority priority);
+  // Spin for a while, waiting for tasks to show up. Return true if they did.
+  bool Spin();
+  // Where the worker sleeps: on idle_, or in the reactor if there is one, so
+  // that I/O wakes it up too. The same protocol as EventCount.
+  uint64_t PrepareSleep();
+  void CancelSleep();
+  void Sleep(uint64_t key);
   void Take();
   void Release();
+  void Notify();
+  // Run a batch of tasks on an executor worker, then either schedule another
+  // batch or, once the EventQueue is finished, wake up Join.
+  void RunStrand();
 
   std::thread t_;
+  // Serializes calls to lifecycle listeners.
   std::mutex mu_;
   std::mutex join_mu_;
-  std::condition_variable cond_;
-  std::deque<Task> tasks_;
-  bool running_;
-  int count_;
+  // In executor mode, signalled under join_mu_ once the last task has run.
+  std::condition_variable done_cond_;
+  bool done_;
+  // In executor mode, the number of times the EventQueue was notified of new
+  // work, or of a change that may let it finish, since RunStrand last caught
+  // up. RunStrand is scheduled or running as long as this is non-zero.
+  std::atomic<int> notifications_;
+  // Where the worker sleeps when there is nothing to do, unless it has a
+  // reactor.
+  EventCount idle_;
+  std::unique_ptr<Reactor> reactor_;
+  // One lane of tasks per Priority, highest first, for tasks added by other
+  // threads, and one for tasks added by the worker itself.
+  MpscQueue<Task> tasks_[kNumPriorities];
+  LocalLane local_tasks_[kNumPriorities];
+  // How many local tasks have run since the last task from tasks_. Only used
+  // by the worker.
+  int local_run_;
+  // How many times in a row each lane has been passed over while it had tasks.
+  // Only used by the worker.
+  int passed_over_[kNumPriorities];
+  // The number of tasks in the lanes, counting those being pushed.
+  std::atomic<int> depth_;
+  // The number of tasks that kDropOldest producers left for the worker to
+  // drop.
+  std::atomic<int> drops_owed_;
+  std::atomic<long> dropped_;
+  // Where producers blocked by kBlock wait for room.
+  EventCount space_;
+  std::atomic<bool> running_;
+  std::atomic<int> count_;
+  // The number of threads in Release. Once the last lease is released, the
+  // worker may finish before Release has notified it, so the destructor waits
+  // for them to leave.
+  std::atomic<int> releasing_;
+  const Options options_;
+  // How long the worker currently spins before it goes to sleep. Only used by
+  // the worker thread.
+  std::chrono::nanoseconds spin_;
   std::shared_ptr<EventQueueListener> eq_listener_;
 };
 
@@ -0,0 +1,1124 @@
+// Benchmarks for the EventQueue task queue, comparing the lock-free MpscQueue
+// that EventQueue uses against a std::deque protected by a std::mutex, which it
+// used to use. The first table measures contention, with many producer threads
+// feeding one consumer. The second measures how fast a consumer drains a queue
+// that has built up to a given depth. The third measures the latency of
+// bouncing a value back and forth between two EventQueues with a chain of
+// Promise::Then calls, depending on how long idle workers spin. The fourth
+// passes values around a ring of many EventQueues, each with a thread of its
+// own or all sharing the threads of an Executor. The fifth measures the latency
+// of tasks enqueued with different priorities into an EventQueue that is
+// saturated with low priority work. The sixth measures how fast a long chain of
+// Promise::Then calls runs, in one EventQueue or alternating between two, with
+// a Then for every link or a Then for every Pipe of eight links. The seventh
+// compares calling Enqueue in a loop with EnqueueBatch. The eighth compares a
+// handler that makes three calls to another EventQueue, written with nested
+// calls to Then or as a coroutine. The ninth hands a large result to many
+// EventQueues, each getting a copy of it or sharing it. The tenth has many
+// threads calling Then on one Promise while it is resolved. The eleventh counts
+// the heap allocations made by CreateResolver, Enqueue, Then and ThenInline
+// with a small continuation, and Then with one that captures 32 bytes. The
+// twelfth gathers the results of many EventQueues, with a Then each or with
+// WhenAll. The thirteenth puts timeouts on Promises that are resolved in time,
+// with many other timeouts outstanding. The fourteenth makes requests to a
+// replica that stalls now and then, alone or hedged with a second replica. The
+// fifteenth runs ParallelMap and ParallelReduce on Executors of more and more
+// threads. The sixteenth looks up a few keys many times at once, with or
+// without an AsyncCache in front of the loads. The seventeenth waits for
+// Promises from a thread that is not an EventQueue's, with Get. The eighteenth
+// passes results through an adapter that picks a field out of each, with Then
+// or ThenInline.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "cpppromise.h"
+#include "executor.h"
+#include "mpsc_queue_impl.h"
+#include "non_csp_utils.h"
+
+namespace {
+
+constexpr int kTotalTasks = 1 << 20;
+
+// The task queue as EventQueue used to have it: every push and every pop takes
+// the one mutex.
+class LockedQueue {
+ public:
+  explicit LockedQueue(int n) : consumer_([this, n]() { Consume(n); }) {}
+
+  ~LockedQueue() { consumer_.join(); }
+
+  void Push(std::function<void()> f) {
+    std::unique_lock<std::mutex> lock(mu_);
+    tasks_.push_back(f);
+    cond_.notify_one();
+  }
+
+ private:
+  void Consume(int n) {
+    while (n > 0) {
+      std::function<void()> f;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (tasks_.empty()) {
+          cond_.wait(lock);
+          continue;
+        }
+        f = tasks_.front();
+        tasks_.pop_front();
+      }
+      f();
+      n--;
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> tasks_;
+  std::thread consumer_;
+};
+
+// Like LockedQueue, but the consumer swaps out everything that is pending under
+// one lock, then runs it all without the lock.
+class SwapQueue {
+ public:
+  explicit SwapQueue(int n) : consumer_([this, n]() { Consume(n); }) {}
+
+  ~SwapQueue() { consumer_.join(); }
+
+  void Push(std::function<void()> f) {
+    std::unique_lock<std::mutex> lock(mu_);
+    tasks_.push_back(f);
+    cond_.notify_one();
+  }
+
+ private:
+  void Consume(int n) {
+    std::deque<std::function<void()>> batch;
+    while (n > 0) {
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (tasks_.empty()) {
+          cond_.wait(lock);
+          continue;
+        }
+        batch.swap(tasks_);
+      }
+      for (auto &f : batch) {
+        f();
+        n--;
+      }
+      batch.clear();
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> tasks_;
+  std::thread consumer_;
+};
+
+// The task queue as EventQueue has it now: pushes and pops are lock-free, and
+// the mutex is only touched to put the consumer to sleep or wake it up.
+class LockFreeQueue {
+ public:
+  explicit LockFreeQueue(int n) : consumer_([this, n]() { Consume(n); }) {}
+
+  ~LockFreeQueue() { consumer_.join(); }
+
+  void Push(std::function<void()> f) {
+    tasks_.Push(new Task{{}, f});
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+      std::unique_lock<std::mutex> lock(mu_);
+      cond_.notify_one();
+    }
+  }
+
+ private:
+  struct Task : public cpppromise::MpscNode {
+    std::function<void()> f;
+  };
+
+  void Consume(int n) {
+    while (n > 0) {
+      std::unique_ptr<Task> task(tasks_.Pop());
+      if (!task) {
+        std::unique_lock<std::mutex> lock(mu_);
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (tasks_.Empty()) {
+          cond_.wait(lock);
+        }
+        sleeping_.store(false, std::memory_order_relaxed);
+        continue;
+      }
+      task->f();
+      n--;
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::atomic<bool> sleeping_{false};
+  cpppromise::MpscQueue<Task> tasks_;
+  std::thread consumer_;
+};
+
+// The whole EventQueue::Enqueue path, including the Promise it returns.
+class WholeEventQueue {
+ public:
+  explicit WholeEventQueue(int n) {}
+
+  void Push(std::function<void()> f) { q_.Enqueue(f); }
+
+ private:
+  cpppromise::EventQueue q_;
+};
+
+template <typename Q>
+double TasksPerSecond(int num_producers) {
+  const int per_producer = kTotalTasks / num_producers;
+  std::atomic<int> ran(0);
+  std::atomic<bool> go(false);
+  Q q(per_producer * num_producers);
+
+  std::vector<std::thread> producers;
+  for (int i = 0; i < num_producers; i++) {
+    producers.push_back(std::thread([&]() {
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      for (int j = 0; j < per_producer; j++) {
+        q.Push([&ran]() { ran.fetch_add(1, std::memory_order_relaxed); });
+      }
+    }));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  go.store(true);
+  for (auto &t : producers) {
+    t.join();
+  }
+  while (ran.load() < per_producer * num_producers) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return ran.load() / elapsed.count();
+}
+
+// Repeatedly hold up the consumer, let "depth" tasks pile up, then measure how
+// quickly the consumer gets through them.
+template <typename Q>
+double DrainTasksPerSecond(int depth) {
+  const int rounds = std::max(1, kTotalTasks / depth);
+  std::atomic<int> ran(0);
+  std::atomic<bool> open(false);
+  std::chrono::duration<double> elapsed(0);
+  Q q(rounds * (depth + 1));
+
+  for (int i = 0; i < rounds; i++) {
+    open.store(false);
+    q.Push([&open]() {
+      while (!open.load()) {
+        std::this_thread::yield();
+      }
+    });
+    for (int j = 0; j < depth; j++) {
+      q.Push([&ran]() { ran.fetch_add(1, std::memory_order_relaxed); });
+    }
+    const int target = (i + 1) * depth;
+    auto start = std::chrono::steady_clock::now();
+    open.store(true);
+    while (ran.load() < target) {
+      std::this_thread::yield();
+    }
+    elapsed += std::chrono::steady_clock::now() - start;
+  }
+  return ran.load() / elapsed.count();
+}
+
+// Return the latency, in microseconds, of each hop of a value bouncing back and
+// forth between two EventQueues.
+std::vector<double> HopLatencies(std::chrono::nanoseconds max_spin) {
+  constexpr int kHops = 20000;
+  cpppromise::EventQueue::Options options;
+  options.max_spin = max_spin;
+  cpppromise::EventQueue q0("", options);
+  cpppromise::EventQueue q1("", options);
+
+  std::vector<std::chrono::steady_clock::time_point> times(kHops + 1);
+  auto pr = cpppromise::EventQueue::CreateResolver<int>();
+  cpppromise::Promise<int> p = pr.first;
+  for (int i = 0; i < kHops; i++) {
+    p = p.Then<int>(i % 2 == 0 ? &q0 : &q1, [&times](int k) {
+      times[k + 1] = std::chrono::steady_clock::now();
+      return k + 1;
+    });
+  }
+  times[0] = std::chrono::steady_clock::now();
+  pr.second.Resolve(0);
+  q0.Finish();
+  q1.Finish();
+  q0.Join();
+  q1.Join();
+
+  std::vector<double> latencies;
+  for (int i = 0; i < kHops; i++) {
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(times[i + 1] - times[i])
+            .count());
+  }
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+// Pass kTokens values around a ring of num_queues EventQueues, each for
+// kLaps laps, and return the number of hops per second. If executor is set,
+// the EventQueues run on it instead of on threads of their own.
+double RingHopsPerSecond(int num_queues, cpppromise::Executor *executor) {
+  constexpr int kTokens = 16;
+  constexpr int kLaps = 4;
+  cpppromise::EventQueue::Options options =
+      cpppromise::EventQueue::GetDefaultOptions();
+  options.executor = executor;
+  std::vector<std::unique_ptr<cpppromise::EventQueue>> queues;
+  for (int i = 0; i < num_queues; i++) {
+    queues.push_back(std::make_unique<cpppromise::EventQueue>("", options));
+  }
+
+  std::vector<cpppromise::Resolver<int>> resolvers;
+  std::atomic<int> finished(0);
+  for (int t = 0; t < kTokens; t++) {
+    auto pr = cpppromise::EventQueue::CreateResolver<int>();
+    resolvers.push_back(pr.second);
+    cpppromise::Promise<int> p = pr.first;
+    for (int hop = 0; hop < kLaps * num_queues; hop++) {
+      cpppromise::EventQueue *q = queues[(t + hop) % num_queues].get();
+      p = p.Then<int>(q, [](int k) { return k + 1; });
+    }
+    p.Then<cpppromise::Empty>(queues[0].get(), [&finished](int k) {
+      finished++;
+      return cpppromise::Empty();
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto &r : resolvers) {
+    r.Resolve(0);
+  }
+  while (finished.load() < kTokens) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (auto &q : queues) {
+    q->Finish();
+  }
+  queues.clear();
+  return kTokens * kLaps * num_queues / elapsed.count();
+}
+
+// Keep q saturated with a backlog of low priority tasks that each take a few
+// microseconds, meanwhile enqueue probe tasks with the given priority every
+// so often, and return the latencies of the probes in microseconds, from
+// enqueue to start.
+std::vector<double> ProbeLatencies(cpppromise::Priority priority) {
+  constexpr int kProbes = 2000;
+  constexpr int kBacklog = 1000;
+  cpppromise::EventQueue q;
+  std::atomic<int> outstanding(0);
+  std::atomic<bool> done(false);
+
+  std::thread bulk([&]() {
+    while (!done.load()) {
+      if (outstanding.load() >= kBacklog) {
+        std::this_thread::yield();
+        continue;
+      }
+      outstanding++;
+      q.Enqueue(
+          [&outstanding]() {
+            auto until =
+                std::chrono::steady_clock::now() + std::chrono::microseconds(2);
+            while (std::chrono::steady_clock::now() < until) {
+            }
+            outstanding--;
+          },
+          "", cpppromise::Priority::kLow);
+    }
+  });
+  while (outstanding.load() < kBacklog) {
+    std::this_thread::yield();
+  }
+
+  std::vector<double> latencies(kProbes);
+  std::atomic<int> probed(0);
+  for (int i = 0; i < kProbes; i++) {
+    auto enqueued = std::chrono::steady_clock::now();
+    q.Enqueue(
+        [&latencies, &probed, enqueued, i]() {
+          latencies[i] = std::chrono::duration<double, std::micro>(
+                             std::chrono::steady_clock::now() - enqueued)
+                             .count();
+          probed++;
+        },
+        "", priority);
+    while (probed.load() <= i) {
+      std::this_thread::yield();
+    }
+  }
+  done.store(true);
+  bulk.join();
+  q.Finish();
+  q.Join();
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+// Run a chain of Promise::Then calls, alternating between the given number of
+// EventQueues, and return the number of links per second. If piped is set,
+// each Then runs a Pipe of eight links at once.
+double ChainLinksPerSecond(int num_queues, bool piped) {
+  constexpr int kLinks = 1 << 18;
+  std::vector<std::unique_ptr<cpppromise::EventQueue>> queues;
+  for (int i = 0; i < num_queues; i++) {
+    queues.push_back(std::make_unique<cpppromise::EventQueue>());
+  }
+  auto pr = cpppromise::EventQueue::CreateResolver<int>();
+  cpppromise::Promise<int> p = pr.first;
+  auto link = [](int k) { return k + 1; };
+  for (int i = 0; i < kLinks; i++) {
+    cpppromise::EventQueue *q = queues[i % num_queues].get();
+    if (piped) {
+      p = p.Then(q, cpppromise::Pipe(link, link, link, link, link, link, link,
+                                     link));
+      i += 7;
+    } else {
+      p = p.Then<int>(q, link);
+    }
+  }
+  std::atomic<bool> done(false);
+  p.Then<cpppromise::Empty>(queues[0].get(), [&done](int k) {
+    done = true;
+    return cpppromise::Empty();
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  pr.second.Resolve(0);
+  while (!done.load()) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (auto &q : queues) {
+    q->Finish();
+  }
+  queues.clear();
+  return kLinks / elapsed.count();
+}
+
+// Enqueue kTotalTasks tasks in groups of batch_size, either one at a time or
+// with EnqueueBatch, and return the number of tasks per second.
+double FanOutTasksPerSecond(int batch_size, bool batched) {
+  cpppromise::EventQueue q;
+  std::atomic<int> done(0);
+  std::vector<std::function<void()>> fs(batch_size,
+                                        [&done]() { done++; });
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kTotalTasks; i += batch_size) {
+    if (batched) {
+      q.EnqueueBatch(fs);
+    } else {
+      for (auto &f : fs) {
+        q.Enqueue(f);
+      }
+    }
+  }
+  while (done.load() < kTotalTasks) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  q.Finish();
+  q.Join();
+  return kTotalTasks / elapsed.count();
+}
+
+// A handler that asks other for three numbers, one after the other, and adds
+// them up, written with Promise::Then.
+cpppromise::Promise<int> ThenHandler(cpppromise::EventQueue *other) {
+  auto pr = cpppromise::EventQueue::CreateResolver<int>();
+  other->Enqueue<int>([]() { return 1; })
+      .Then([other, resolver = pr.second](int a) {
+        other->Enqueue<int>([]() { return 2; })
+            .Then([other, resolver, a](int b) {
+              other->Enqueue<int>([]() { return 3; })
+                  .Then([resolver, a, b](int c) mutable {
+                    resolver.Resolve(a + b + c);
+                  });
+            });
+      });
+  return pr.first;
+}
+
+// The same handler, as a coroutine.
+cpppromise::Promise<int> CoroutineHandler(cpppromise::EventQueue *other) {
+  int a = co_await other->Enqueue<int>([]() { return 1; });
+  int b = co_await other->Enqueue<int>([]() { return 2; });
+  int c = co_await other->Enqueue<int>([]() { return 3; });
+  co_return a + b + c;
+}
+
+// Run kRequests requests through handler, at most kInFlight at a time, and
+// return the number of requests per second and the number of allocations per
+// request.
+std::pair<double, double> HandlerCosts(
+    cpppromise::Promise<int> (*handler)(cpppromise::EventQueue *)) {
+  constexpr int kRequests = 1 << 16;
+  constexpr int kInFlight = 64;
+  cpppromise::EventQueue q;
+  cpppromise::EventQueue other;
+  std::atomic<int> done(0);
+  // Each request that completes starts the next one, until there are enough.
+  std::function<void()> start = [&]() {
+    handler(&other).Then([&](int) {
+      if (++done <= kRequests - kInFlight) {
+        start();
+      }
+    });
+  };
+
+  cpppromise::allocation_count.store(0);
+  cpppromise::counting_allocations.store(true);
+  auto begin = std::chrono::steady_clock::now();
+  q.Enqueue([&]() {
+    for (int i = 0; i < kInFlight; i++) {
+      start();
+    }
+  });
+  while (done.load() < kRequests) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  cpppromise::counting_allocations.store(false);
+  q.Finish();
+  q.Join();
+  other.Finish();
+  other.Join();
+  return {kRequests / elapsed.count(),
+          static_cast<double>(cpppromise::allocation_count.load()) / kRequests};
+}
+
+// Resolve a Promise of a 1 MB blob that kQueues EventQueues are waiting for,
+// kRounds times, and return the time each round takes, in usec.
+double FanOutResultMicros(bool share) {
+  constexpr int kQueues = 50;
+  constexpr int kRounds = 100;
+  std::vector<std::unique_ptr<cpppromise::EventQueue>> queues;
+  for (int i = 0; i < kQueues; i++) {
+    queues.push_back(std::make_unique<cpppromise::EventQueue>());
+  }
+  std::atomic<long> sum(0);
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < kRounds; round++) {
+    auto pr = cpppromise::EventQueue::CreateResolver<std::vector<char>>();
+    auto shared = pr.first.Share();
+    for (auto &q : queues) {
+      if (share) {
+        shared.Then<cpppromise::Empty>(
+            q.get(), [&sum](std::shared_ptr<const std::vector<char>> blob) {
+              sum += (*blob)[0];
+              return cpppromise::Empty();
+            });
+      } else {
+        pr.first.Then<cpppromise::Empty>(
+            q.get(), [&sum](std::vector<char> blob) {
+              sum += blob[0];
+              return cpppromise::Empty();
+            });
+      }
+    }
+    pr.second.Resolve(std::vector<char>(1 << 20, 1));
+    while (sum.load() < (round + 1) * kQueues) {
+      std::this_thread::yield();
+    }
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (auto &q : queues) {
+    q->Finish();
+  }
+  queues.clear();
+  return elapsed.count() / kRounds;
+}
+
+// Return how many continuations per second a number of threads, together, add
+// with Then to a series of Promises, each of which is resolved while they are
+// at it.
+double HotPromiseThensPerSecond(int threads) {
+  constexpr int kRounds = 50;
+  constexpr int kThens = 2000;
+  cpppromise::EventQueue q;
+  std::vector<std::pair<cpppromise::Promise<int>, cpppromise::Resolver<int>>>
+      rounds;
+  for (int round = 0; round < kRounds; round++) {
+    rounds.push_back(cpppromise::EventQueue::CreateResolver<int>());
+  }
+  // How many threads have started on each round, and how many rounds have
+  // been resolved.
+  std::vector<std::atomic<int>> started(kRounds);
+  std::atomic<int> resolved(0);
+  std::atomic<long> ran(0);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> adders;
+  for (int t = 0; t < threads; t++) {
+    adders.emplace_back([&]() {
+      for (int round = 0; round < kRounds; round++) {
+        started[round]++;
+        for (int i = 0; i < kThens; i++) {
+          rounds[round].first.Then<cpppromise::Empty>(&q, [&ran](int k) {
+            ran++;
+            return cpppromise::Empty();
+          });
+        }
+        // Do not run ahead to the next round before this one is resolved.
+        while (resolved.load() <= round) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (int round = 0; round < kRounds; round++) {
+    while (started[round].load() < threads) {
+      std::this_thread::yield();
+    }
+    rounds[round].second.Resolve(round);
+    resolved++;
+  }
+  for (auto &adder : adders) {
+    adder.join();
+  }
+  long total = static_cast<long>(kRounds) * threads * kThens;
+  while (ran.load() < total) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  q.Finish();
+  q.Join();
+  return total / elapsed.count();
+}
+
+// Return the number of allocations that each call to make_promise makes,
+// including those made by running the work it sets up, averaged over many
+// calls from within an EventQueue.
+double AllocationsPer(
+    std::function<cpppromise::Promise<int>(cpppromise::EventQueue *)>
+        make_promise) {
+  constexpr int kCalls = 1 << 14;
+  cpppromise::EventQueue q;
+  std::atomic<int> done(0);
+  auto run = [&]() {
+    q.Enqueue([&]() {
+      for (int i = 0; i < kCalls; i++) {
+        make_promise(&q);
+      }
+      q.Enqueue([&done]() { done++; });
+    });
+  };
+  // Warm up the free lists first. This takes two rounds: when this thread
+  // first enqueues something, it takes all the memory freed by the first round
+  // for itself.
+  for (int round = 1; round <= 2; round++) {
+    run();
+    while (done.load() < round) {
+      std::this_thread::yield();
+    }
+  }
+  cpppromise::allocation_count.store(0);
+  cpppromise::counting_allocations.store(true);
+  run();
+  while (done.load() < 3) {
+    std::this_thread::yield();
+  }
+  cpppromise::counting_allocations.store(false);
+  q.Finish();
+  q.Join();
+  return static_cast<double>(cpppromise::allocation_count.load()) / kCalls;
+}
+
+// Return how many nanoseconds it takes to put a timeout on a Promise that is
+// then resolved in time, which cancels the timer, while a number of other
+// timeouts are outstanding.
+double TimeoutNanos(int outstanding) {
+  constexpr int kCalls = 1 << 14;
+  auto never = cpppromise::EventQueue::CreateResolver<int>();
+  std::vector<cpppromise::Promise<int>> pending;
+  for (int i = 0; i < outstanding; i++) {
+    pending.push_back(never.first.WithTimeout(std::chrono::hours(1)));
+  }
+  // The first round warms up the free lists; only the second one counts.
+  std::chrono::duration<double, std::nano> elapsed;
+  for (int round = 0; round < 2; round++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kCalls; i++) {
+      auto pr = cpppromise::EventQueue::CreateResolver<int>();
+      cpppromise::Promise<int> p = pr.first.WithTimeout(std::chrono::hours(1));
+      pr.second.Resolve(i);
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+  // Cancels the outstanding timers.
+  never.second.Resolve(0);
+  return elapsed.count() / kCalls;
+}
+
+// Return the median and 99th percentile latency, in microseconds, of requests
+// made one at a time to a replica that stalls for 5 msec before one request in
+// fifty. If delay is set, each request is hedged with a second replica after
+// that long, and what Hedge did is counted in stats.
+std::pair<double, double> StalledReplicaMicros(
+    std::optional<std::chrono::microseconds> delay,
+    cpppromise::HedgeStats *stats) {
+  constexpr int kRequests = 2000;
+  cpppromise::EventQueue primary;
+  cpppromise::EventQueue backup;
+  cpppromise::EventQueue waiter;
+  std::function<int()> request = []() {
+    auto until =
+        std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+    return 1;
+  };
+  std::vector<double> latencies;
+  for (int i = 0; i < kRequests; i++) {
+    if (i % 50 == 0) {
+      primary.Enqueue([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      });
+    }
+    std::atomic<bool> done(false);
+    auto start = std::chrono::steady_clock::now();
+    cpppromise::Promise<int> p =
+        delay ? cpppromise::Hedge<int>(&primary, &backup, request, *delay,
+                                       stats)
+              : primary.Enqueue<int>(request);
+    p.Then(&waiter, [&done](int) { done = true; });
+    while (!done) {
+      std::this_thread::yield();
+    }
+    latencies.push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+  }
+  for (auto *q : {&primary, &backup, &waiter}) {
+    q->Finish();
+    q->Join();
+  }
+  std::sort(latencies.begin(), latencies.end());
+  return {latencies[kRequests / 2], latencies[kRequests * 99 / 100]};
+}
+
+// Return how many microseconds it takes to spread 10000 tasks over several
+// EventQueues and gather their results in another, with a Then for each of
+// them that counts down in the gathering EventQueue, or with WhenAll.
+double ScatterGatherMicros(bool when_all) {
+  constexpr int kQueues = 8;
+  constexpr int kShards = 10000;
+  constexpr int kRounds = 20;
+  std::vector<std::unique_ptr<cpppromise::EventQueue>> queues;
+  for (int i = 0; i < kQueues; i++) {
+    queues.push_back(std::make_unique<cpppromise::EventQueue>());
+  }
+  cpppromise::EventQueue gather;
+  std::atomic<int> done(0);
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < kRounds; round++) {
+    gather.Enqueue([&]() {
+      std::vector<cpppromise::Promise<int>> shards;
+      shards.reserve(kShards);
+      for (int i = 0; i < kShards; i++) {
+        shards.push_back(
+            queues[i % kQueues]->Enqueue<int>([i]() { return i; }));
+      }
+      if (when_all) {
+        cpppromise::WhenAll(std::move(shards))
+            .Then<cpppromise::Empty>(&gather, [&done](std::vector<int> v) {
+              done++;
+              return cpppromise::Empty();
+            });
+        return;
+      }
+      auto results = std::make_shared<std::vector<int>>(kShards);
+      auto remaining = std::make_shared<int>(kShards);
+      for (int i = 0; i < kShards; i++) {
+        shards[i].Then<cpppromise::Empty>(
+            &gather, [results, remaining, i, &done](int k) {
+              (*results)[i] = k;
+              if (--*remaining == 0) {
+                done++;
+              }
+              return cpppromise::Empty();
+            });
+      }
+    });
+    while (done.load() < round + 1) {
+      std::this_thread::yield();
+    }
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  gather.Finish();
+  for (auto &q : queues) {
+    q->Finish();
+  }
+  return elapsed.count() / kRounds;
+}
+
+}  // namespace
+
+// A few hundred nanoseconds of arithmetic, for the parallel loops to chew on.
+double Churn(double x) {
+  for (int i = 0; i < 64; i++) {
+    x = std::sqrt(x + i);
+  }
+  return x;
+}
+
+// Return how many milliseconds it takes ParallelMap, or ParallelReduce, to
+// apply Churn to a million numbers on an Executor of the given number of
+// threads, or a plain loop to do so if threads is zero.
+double ParallelMillis(int threads, bool reduce) {
+  constexpr int kSize = 1 << 20;
+  std::vector<double> input(kSize);
+  for (int i = 0; i < kSize; i++) {
+    input[i] = i;
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (threads == 0) {
+    std::vector<double> output(kSize);
+    double sum = 0;
+    for (int i = 0; i < kSize; i++) {
+      if (reduce) {
+        sum += Churn(input[i]);
+      } else {
+        output[i] = Churn(input[i]);
+      }
+    }
+    volatile double sink = reduce ? sum : output[kSize / 2];
+    (void)sink;
+  } else {
+    cpppromise::Executor executor(threads);
+    cpppromise::EventQueue q;
+    std::atomic<bool> done(false);
+    if (reduce) {
+      cpppromise::ParallelReduce(
+          &executor, std::move(input), 0.0,
+          [](double sum, double x) { return sum + Churn(x); },
+          [](double a, double b) { return a + b; })
+          .Then(&q, [&done](double) { done = true; });
+    } else {
+      cpppromise::ParallelMap(&executor, std::move(input), Churn)
+          .Then(&q, [&done](std::vector<double>) { done = true; });
+    }
+    while (!done) {
+      std::this_thread::yield();
+    }
+    q.Finish();
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Return how many loads a burst of 1000 lookups of 10 keys, made by 4 threads
+// at once, costs, and how many milliseconds it takes for them all to be
+// answered, with or without an AsyncCache in front of the loads. Each load
+// keeps an EventQueue busy for 100 usec.
+std::pair<long, double> BurstLoads(bool cached) {
+  constexpr int kThreads = 4;
+  constexpr int kLookups = 1000;
+  cpppromise::EventQueue backend;
+  cpppromise::EventQueue waiter;
+  std::atomic<long> loads(0);
+  std::function<cpppromise::Promise<int>(const int &)> load =
+      [&](const int &key) {
+        loads++;
+        return backend.Enqueue<int>([key]() {
+          auto until =
+              std::chrono::steady_clock::now() + std::chrono::microseconds(100);
+          while (std::chrono::steady_clock::now() < until) {
+          }
+          return key;
+        });
+      };
+  cpppromise::AsyncCache<int, int> cache(load);
+  std::atomic<int> answered(0);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (int i = t; i < kLookups; i += kThreads) {
+        (cached ? cache.Get(i % 10) : load(i % 10))
+            .Then(&waiter, [&answered](int) { answered++; });
+      }
+    }));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  while (answered < kLookups) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  backend.Finish();
+  waiter.Finish();
+  return {loads.load(), elapsed.count()};
+}
+
+// Return how many microseconds it takes a plain thread to Get the result of a
+// task that it enqueues.
+double GetMicros() {
+  constexpr int kCalls = 10000;
+  cpppromise::EventQueue q;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kCalls; i++) {
+    cpppromise::Get(q.Enqueue<int>([i]() { return i; }));
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  q.Finish();
+  q.Join();
+  return elapsed.count() / kCalls;
+}
+
+// Return how many results per second make it from a backend EventQueue to a
+// client EventQueue through an adapter that picks a field out of each, which
+// runs with Then in an EventQueue of its own, or with ThenInline.
+double AdaptedResultsPerSecond(bool inline_adapter) {
+  constexpr int kResults = 1 << 17;
+  cpppromise::EventQueue backend;
+  cpppromise::EventQueue adapter;
+  cpppromise::EventQueue client;
+  std::atomic<int> received(0);
+  auto field = [](std::pair<int, int> result) { return result.second; };
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kResults; i++) {
+    auto result = backend.Enqueue<std::pair<int, int>>(
+        [i]() { return std::make_pair(i, i); });
+    (inline_adapter ? result.ThenInline(field) : result.Then(&adapter, field))
+        .Then(&client, [&received](int) { received++; });
+  }
+  while (received < kResults) {
+    std::this_thread::yield();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (auto *q : {&backend, &adapter, &client}) {
+    q->Finish();
+  }
+  return kResults / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  std::printf("%d tasks, one consumer; throughput in millions of tasks/sec\n",
+              kTotalTasks);
+  std::printf("%10s %14s %14s %14s %14s\n", "producers", "deque+mutex",
+              "deque+swap", "mpsc", "EventQueue");
+  for (int producers : {1, 2, 4, 8, 16, 32}) {
+    std::printf("%10d %14.2f %14.2f %14.2f %14.2f\n", producers,
+                TasksPerSecond<LockedQueue>(producers) / 1e6,
+                TasksPerSecond<SwapQueue>(producers) / 1e6,
+                TasksPerSecond<LockFreeQueue>(producers) / 1e6,
+                TasksPerSecond<WholeEventQueue>(producers) / 1e6);
+  }
+
+  std::printf("\nDraining a backlog; millions of tasks/sec by queue depth\n");
+  std::printf("%10s %14s %14s %14s %14s\n", "depth", "deque+mutex",
+              "deque+swap", "mpsc", "EventQueue");
+  for (int depth : {1, 16, 256, 4096, 65536}) {
+    std::printf("%10d %14.2f %14.2f %14.2f %14.2f\n", depth,
+                DrainTasksPerSecond<LockedQueue>(depth) / 1e6,
+                DrainTasksPerSecond<SwapQueue>(depth) / 1e6,
+                DrainTasksPerSecond<LockFreeQueue>(depth) / 1e6,
+                DrainTasksPerSecond<WholeEventQueue>(depth) / 1e6);
+  }
+
+  std::printf("\nPing-pong between two EventQueues; hop latency in usec\n");
+  std::printf("%10s %10s %10s %10s\n", "max_spin", "p50", "p99", "p99.9");
+  for (int spin_micros : {0, 5, 20, 100}) {
+    std::vector<double> latencies =
+        HopLatencies(std::chrono::microseconds(spin_micros));
+    std::printf("%8dus %10.2f %10.2f %10.2f\n", spin_micros,
+                latencies[latencies.size() / 2],
+                latencies[latencies.size() * 99 / 100],
+                latencies[latencies.size() * 999 / 1000]);
+  }
+
+  cpppromise::Executor executor;
+  std::printf("\nA ring of EventQueues; millions of hops/sec\n");
+  std::printf("%10s %14s %14s\n", "queues", "threads", "executor");
+  for (int queues : {4, 64, 1024}) {
+    std::printf("%10d %14.2f %14.2f\n", queues,
+                RingHopsPerSecond(queues, nullptr) / 1e6,
+                RingHopsPerSecond(queues, &executor) / 1e6);
+  }
+
+  std::printf("\nProbes into an EventQueue saturated with low priority work;"
+              " latency in usec\n");
+  std::printf("%10s %10s %10s %10s\n", "priority", "p50", "p99", "p99.9");
+  const char *names[] = {"high", "normal", "low"};
+  for (auto priority : {cpppromise::Priority::kLow,
+                        cpppromise::Priority::kNormal,
+                        cpppromise::Priority::kHigh}) {
+    std::vector<double> latencies = ProbeLatencies(priority);
+    std::printf("%10s %10.2f %10.2f %10.2f\n",
+                names[static_cast<int>(priority)],
+                latencies[latencies.size() / 2],
+                latencies[latencies.size() * 99 / 100],
+                latencies[latencies.size() * 999 / 1000]);
+  }
+
+  std::printf("\nA chain of Promise::Then; millions of links/sec\n");
+  std::printf("%10s %14s %14s\n", "queues", "Then", "Pipe of 8");
+  for (int queues : {1, 2}) {
+    std::printf("%10d %14.2f %14.2f\n", queues,
+                ChainLinksPerSecond(queues, false) / 1e6,
+                ChainLinksPerSecond(queues, true) / 1e6);
+  }
+
+  std::printf("\nFan-out into one EventQueue; millions of tasks/sec\n");
+  std::printf("%10s %14s %14s\n", "batch", "Enqueue", "EnqueueBatch");
+  for (int batch_size : {1, 8, 64, 1024}) {
+    std::printf("%10d %14.2f %14.2f\n", batch_size,
+                FanOutTasksPerSecond(batch_size, false) / 1e6,
+                FanOutTasksPerSecond(batch_size, true) / 1e6);
+  }
+
+  std::printf("\nA handler making three calls to another EventQueue\n");
+  std::printf("%10s %14s %14s\n", "", "requests/sec", "allocs/request");
+  std::pair<double, double> then_costs = HandlerCosts(ThenHandler);
+  std::printf("%10s %14.0f %14.1f\n", "Then", then_costs.first,
+              then_costs.second);
+  std::pair<double, double> coroutine_costs = HandlerCosts(CoroutineHandler);
+  std::printf("%10s %14.0f %14.1f\n", "co_await", coroutine_costs.first,
+              coroutine_costs.second);
+
+  std::printf("\nA 1 MB result for 50 EventQueues; usec per round\n");
+  std::printf("%10s %14.0f\n", "Then", FanOutResultMicros(false));
+  std::printf("%10s %14.0f\n", "Share", FanOutResultMicros(true));
+
+  std::printf("\nThen on a Promise that is being resolved\n");
+  std::printf("%10s %14s\n", "threads", "M Thens/sec");
+  for (int threads : {1, 2, 4, 8}) {
+    std::printf("%10d %14.2f\n", threads,
+                HotPromiseThensPerSecond(threads) / 1e6);
+  }
+
+  std::printf("\nAllocations per call\n");
+  std::printf("%16s %10.2f\n", "CreateResolver",
+              AllocationsPer([](cpppromise::EventQueue *q) {
+                auto pr = cpppromise::EventQueue::CreateResolver<int>();
+                pr.second.Resolve(1);
+                return pr.first;
+              }));
+  std::printf("%16s %10.2f\n", "Enqueue",
+              AllocationsPer([](cpppromise::EventQueue *q) {
+                return q->Enqueue<int>([]() { return 1; });
+              }));
+  auto resolved = cpppromise::EventQueue::CreateResolvedPromise<int>(1);
+  std::printf("%16s %10.2f\n", "Then",
+              AllocationsPer([resolved](cpppromise::EventQueue *q) mutable {
+                return resolved.Then<int>(q, [](int k) { return k + 1; });
+              }));
+  std::printf("%16s %10.2f\n", "ThenInline",
+              AllocationsPer([resolved](cpppromise::EventQueue *q) mutable {
+                return resolved.ThenInline([](int k) { return k + 1; });
+              }));
+  std::printf("%16s %10.2f\n", "Then, 32 B",
+              AllocationsPer([resolved](cpppromise::EventQueue *q) mutable {
+                int64_t a = 1, b = 2, c = 3, d = 4;
+                return resolved.Then<int>(
+                    q, [a, b, c, d](int k) { return k + a + b + c + d; });
+              }));
+
+  std::printf("\nGathering 10000 results; usec per round\n");
+  std::printf("%10s %14.0f\n", "Then", ScatterGatherMicros(false));
+  std::printf("%10s %14.0f\n", "WhenAll", ScatterGatherMicros(true));
+
+  std::printf("\nA timeout resolved in time; nsec per call\n");
+  std::printf("%12s %14s\n", "outstanding", "nsec");
+  for (int outstanding : {0, 1000, 100000}) {
+    std::printf("%12d %14.0f\n", outstanding, TimeoutNanos(outstanding));
+  }
+
+  std::printf("\nRequests to a replica that stalls now and then; usec\n");
+  std::printf("%12s %10s %10s %10s %10s\n", "hedge after", "p50", "p99",
+              "hedged", "backup won");
+  for (int delay_us : {0, 1000, 200}) {
+    cpppromise::HedgeStats stats;
+    auto delay = delay_us == 0 ? std::nullopt
+                               : std::make_optional(
+                                     std::chrono::microseconds(delay_us));
+    auto [p50, p99] = StalledReplicaMicros(delay, &stats);
+    long calls = std::max(1L, stats.calls.load());
+    std::printf("%12s %10.0f %10.0f %9.1f%% %9.1f%%\n",
+                delay ? std::to_string(delay_us).c_str() : "never", p50, p99,
+                100.0 * stats.hedged / calls,
+                100.0 * stats.backup_wins / calls);
+  }
+
+  std::printf("\nParallel loops over a million elements; msec (speedup)\n");
+  std::printf("%10s %18s %18s\n", "threads", "ParallelMap",
+              "ParallelReduce");
+  double serial_map = ParallelMillis(0, false);
+  double serial_reduce = ParallelMillis(0, true);
+  std::printf("%10s %10.1f %7s %10.1f\n", "loop", serial_map, "",
+              serial_reduce);
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 1; threads <= std::max(8, max_threads); threads *= 2) {
+    double map = ParallelMillis(threads, false);
+    double reduce = ParallelMillis(threads, true);
+    std::printf("%10d %10.1f (%4.1fx) %10.1f (%4.1fx)\n", threads, map,
+                serial_map / map, reduce, serial_reduce / reduce);
+  }
+
+  std::printf("\n1000 lookups of 10 keys at once; loads and msec\n");
+  std::printf("%12s %10s %10s\n", "", "loads", "msec");
+  for (bool cached : {false, true}) {
+    auto [loads, millis] = BurstLoads(cached);
+    std::printf("%12s %10ld %10.1f\n", cached ? "AsyncCache" : "uncached",
+                loads, millis);
+  }
+
+  std::printf("\nGet from a plain thread; usec per call\n");
+  std::printf("%10s %14.1f\n", "Get", GetMicros());
+
+  std::printf("\nResults through an adapter; M results/sec\n");
+  std::printf("%10s %14.2f\n", "Then", AdaptedResultsPerSecond(false) / 1e6);
+  std::printf("%10s %14.2f\n", "ThenInline",
+              AdaptedResultsPerSecond(true) / 1e6);
+  return 0;
+}
@@ -6,32 +6,96 @@
 namespace cpppromise {
 
 template <typename T>
-Promise<T> EventQueue::Enqueue(std::function<T()> f, std::string id) {
+Promise<T> EventQueue::Enqueue(std::function<T()> f, std::string id,
+                               Priority priority) {
   std::shared_ptr<PromiseControlBlock<T>> pcb =
-      std::make_shared<PromiseControlBlock<T>>(id);
-  AddTask([this, f, pcb]() { pcb->Resolve(f()); }, id);
+      PromiseControlBlock<T>::Create(id);
+  AddTask(
+      [f = std::move(f), result = PendingResult<T>(pcb)]() mutable {
+        result.Take()->Resolve(f());
+      },
+      std::move(id), priority);
   return Promise<T>(pcb);
 }
 
+template <typename T>
+Promise<T> EventQueue::Enqueue(std::function<T()> f, CancellationToken token,
+                               std::string id, Priority priority) {
+  std::shared_ptr<PromiseControlBlock<T>> pcb =
+      PromiseControlBlock<T>::Create(id, std::move(token));
+  AddTask(
+      [f = std::move(f), result = PendingResult<T>(pcb)]() mutable {
+        std::shared_ptr<PromiseControlBlock<T>> pcb = result.Take();
+        if (!pcb->CancelIfRequested()) {
+          pcb->Resolve(f());
+        }
+      },
+      std::move(id), priority);
+  return Promise<T>(pcb);
+}
+
+template <typename T>
+std::optional<Promise<T>> EventQueue::TryEnqueue(std::function<T()> f,
+                                                 std::string id,
+                                                 Priority priority) {
+  if (!Reserve(OverflowPolicy::kReject)) {
+    return std::nullopt;
+  }
+  std::shared_ptr<PromiseControlBlock<T>> pcb =
+      PromiseControlBlock<T>::Create(id);
+  PushTask(
+      [f = std::move(f), result = PendingResult<T>(pcb)]() mutable {
+        result.Take()->Resolve(f());
+      },
+      std::move(id), priority);
+  return Promise<T>(pcb);
+}
+
+template <typename T>
+std::vector<Promise<T>> EventQueue::EnqueueBatch(
+    std::vector<std::function<T()>> fs, std::string id, Priority priority) {
+  std::vector<Promise<T>> promises;
+  std::vector<TaskFunction> tasks;
+  promises.reserve(fs.size());
+  tasks.reserve(fs.size());
+  for (auto &f : fs) {
+    std::shared_ptr<PromiseControlBlock<T>> pcb =
+        PromiseControlBlock<T>::Create(id);
+    tasks.push_back(
+        [f = std::move(f), result = PendingResult<T>(pcb)]() mutable {
+          result.Take()->Resolve(f());
+        });
+    promises.push_back(Promise<T>(pcb));
+  }
+  AddTasks(std::move(tasks), id, priority);
+  return promises;
+}
+
 template <typename T>
 std::pair<Promise<T>, Resolver<T>> EventQueue::CreateResolver(std::string id) {
-  auto pcb = std::make_shared<PromiseControlBlock<T>>(id);
+  auto pcb = PromiseControlBlock<T>::Create(id);
   return {Promise<T>(pcb), Resolver<T>(pcb)};
 }
 
 template <typename T>
 Promise<T> EventQueue::CreateResolvedPromise(T val, std::string id) {
   auto pair = CreateResolver<T>(id);
-  pair.second.Resolve(val);
+  pair.second.Resolve(std::move(val));
   return pair.first;
 }
 
 template <typename T>
 Promise<T> EventQueue::EnqueueWithResolver(
-    std::function<void(Resolver<T>)> resolve, std::string id) {
-  auto pair = CreateResolver<T>(id);
-  AddTask([resolve, resolver = pair.second]() { resolve(resolver); }, id);
-  return pair.first;
+    std::function<void(Resolver<T>)> resolve, std::string id,
+    Priority priority) {
+  std::shared_ptr<PromiseControlBlock<T>> pcb =
+      PromiseControlBlock<T>::Create(id);
+  AddTask(
+      [resolve = std::move(resolve), result = PendingResult<T>(pcb)]() mutable {
+        resolve(Resolver<T>(result.Take()));
+      },
+      std::move(id), priority);
+  return Promise<T>(pcb);
 }
 
 }  // namespace cpppromise
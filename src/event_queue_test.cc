@@ -0,0 +1,521 @@
+#include "src/cpp_common/cpppromise/event_queue.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/cpp_common/cpppromise/alloc_counter.h"
+#include "src/cpp_common/cpppromise/cpppromise.h"
+
+namespace cpppromise {
+namespace {
+
+constexpr int kTaskCount = 1000;
+
+// Run "enqueue" kTaskCount times, where each call must arrange for "done" to
+// be incremented on q, and return the number of allocations that took place
+// until all that work was done.
+template <typename F>
+long CountAllocations(std::atomic<int> &done, F enqueue) {
+  done.store(0);
+  allocation_count.store(0);
+  counting_allocations.store(true);
+  for (int i = 0; i < kTaskCount; i++) {
+    enqueue();
+  }
+  while (done.load() < kTaskCount) {
+    std::this_thread::yield();
+  }
+  counting_allocations.store(false);
+  return allocation_count.load();
+}
+
+TEST(EventQueueTest, EnqueueDoesNotAllocate) {
+  LifecycleListenerManager::Set(nullptr);
+  EventQueue q;
+  std::atomic<int> done(0);
+
+  // Warm up the free lists of tasks and PromiseControlBlocks. Their memory is
+  // returned by the worker thread and picked up again by this one. Hold up the
+  // worker while we do so, to make sure there are enough to go around even if
+  // it falls behind.
+  std::atomic<bool> go(false);
+  q.Enqueue([&go]() {
+    while (!go.load()) {
+      std::this_thread::yield();
+    }
+  });
+  for (int i = 0; i < 2 * kTaskCount; i++) {
+    q.Enqueue([&done]() { done++; });
+  }
+  go.store(true);
+  while (done.load() < 2 * kTaskCount) {
+    std::this_thread::yield();
+  }
+
+  long enqueue_allocations =
+      CountAllocations(done, [&]() { q.Enqueue([&done]() { done++; }); });
+
+  long promise_allocations = CountAllocations(done, [&]() {
+    EventQueue::CreateResolver<Empty>();
+    done++;
+  });
+
+  EXPECT_EQ(enqueue_allocations, 0);
+  EXPECT_EQ(promise_allocations, 0);
+
+  q.Finish();
+  q.Join();
+}
+
+TEST(EventQueueTest, SpinningQueuesPingPong) {
+  EventQueue::Options options;
+  options.max_spin = std::chrono::microseconds(50);
+  EventQueue q0("", options);
+  EventQueue q1("", options);
+
+  auto pr = EventQueue::CreateResolver<int>();
+  Promise<int> p = pr.first;
+  for (int i = 0; i < 1000; i++) {
+    p = p.Then<int>(i % 2 == 0 ? &q0 : &q1, [](int k) { return k + 1; });
+  }
+  std::atomic<int> result(0);
+  p.Then<Empty>(&q0, [&result](int k) {
+    result = k;
+    return Empty();
+  });
+  pr.second.Resolve(0);
+
+  q0.Finish();
+  q1.Finish();
+  q0.Join();
+  q1.Join();
+  EXPECT_EQ(result.load(), 1000);
+}
+
+// Hold up q's worker until the returned function is called.
+std::function<void()> BlockWorker(EventQueue &q) {
+  auto started = std::make_shared<std::atomic<bool>>(false);
+  auto go = std::make_shared<std::atomic<bool>>(false);
+  q.Enqueue([started, go]() {
+    started->store(true);
+    while (!go->load()) {
+      std::this_thread::yield();
+    }
+  });
+  while (!started->load()) {
+    std::this_thread::yield();
+  }
+  return [go]() { go->store(true); };
+}
+
+TEST(EventQueueTest, HigherPriorityLanesRunFirst) {
+  EventQueue::Options options;
+  options.starvation_limit = 0;
+  EventQueue q("", options);
+  std::vector<std::string> order;
+  auto record = [&order](std::string s) {
+    return [&order, s]() { order.push_back(s); };
+  };
+
+  auto resolved = EventQueue::CreateResolvedPromise<int>(0);
+  std::function<void()> unblock = BlockWorker(q);
+  q.Enqueue(record("low 1"), "", Priority::kLow);
+  q.Enqueue(record("normal 1"));
+  q.Enqueue(record("high 1"), "", Priority::kHigh);
+  q.Enqueue(record("low 2"), "", Priority::kLow);
+  q.Enqueue(record("normal 2"), "", Priority::kNormal);
+  resolved.Then<Empty>(
+      &q,
+      [&order](int) {
+        order.push_back("high 2");
+        return Empty();
+      },
+      "", Priority::kHigh);
+  unblock();
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(order,
+            std::vector<std::string>({"high 1", "high 2", "normal 1",
+                                      "normal 2", "low 1", "low 2"}));
+}
+
+TEST(EventQueueTest, StarvedLanesGetATurn) {
+  EventQueue::Options options;
+  options.starvation_limit = 2;
+  EventQueue q("", options);
+  std::string order;
+
+  std::function<void()> unblock = BlockWorker(q);
+  for (int i = 0; i < 2; i++) {
+    q.Enqueue([&order]() { order += "L"; }, "", Priority::kLow);
+  }
+  for (int i = 0; i < 6; i++) {
+    q.Enqueue([&order]() { order += "H"; }, "", Priority::kHigh);
+  }
+  unblock();
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(order, "HHLHHLHH");
+}
+
+TEST(EventQueueTest, TasksAddedByTheQueueItselfDoNotStarveOthers) {
+  EventQueue q;
+  std::atomic<bool> stop(false);
+  std::function<void()> loop = [&]() {
+    if (!stop.load()) {
+      q.Enqueue(loop);
+    }
+  };
+  q.Enqueue(loop);
+  q.Enqueue([&stop]() { stop.store(true); });
+  q.Finish();
+  q.Join();
+}
+
+TEST(EventQueueTest, RejectsTasksOverCapacity) {
+  EventQueue::Options options;
+  options.capacity = 4;
+  options.overflow_policy = EventQueue::OverflowPolicy::kReject;
+  EventQueue q("", options);
+  std::atomic<int> ran(0);
+
+  std::function<void()> unblock = BlockWorker(q);
+  for (int i = 0; i < 6; i++) {
+    q.Enqueue([&ran]() { ran++; });
+  }
+  EXPECT_EQ(q.Depth(), 4);
+  EXPECT_EQ(q.Dropped(), 2);
+  EXPECT_FALSE(q.TryEnqueue([&ran]() { ran++; }).has_value());
+  unblock();
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(ran.load(), 4);
+  EXPECT_EQ(q.Depth(), 0);
+  EXPECT_EQ(q.Dropped(), 3);
+}
+
+TEST(EventQueueTest, DropsOldestTasksOverCapacity) {
+  EventQueue::Options options;
+  options.capacity = 3;
+  options.overflow_policy = EventQueue::OverflowPolicy::kDropOldest;
+  EventQueue q("", options);
+  std::string order;
+  auto record = [&order](std::string s) {
+    return [&order, s]() { order += s; };
+  };
+
+  std::function<void()> unblock = BlockWorker(q);
+  q.Enqueue(record("a"), "", Priority::kLow);
+  q.Enqueue(record("b"), "", Priority::kLow);
+  q.Enqueue(record("c"));
+  q.Enqueue(record("d"));
+  q.Enqueue(record("e"), "", Priority::kLow);
+  EXPECT_EQ(q.Depth(), 5);
+  unblock();
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(order, "cde");
+  EXPECT_EQ(q.Dropped(), 2);
+}
+
+TEST(EventQueueTest, CancelsRefusedAndDroppedTasks) {
+  EventQueue::Options options;
+  options.capacity = 1;
+  options.overflow_policy = EventQueue::OverflowPolicy::kReject;
+  EventQueue rejecting("", options);
+  options.overflow_policy = EventQueue::OverflowPolicy::kDropOldest;
+  EventQueue dropping("", options);
+  EventQueue out;
+  std::vector<std::optional<Empty>> settled(4, Empty{});
+  auto record = [&out, &settled](Promise<Empty> p, int i) {
+    p.Settled().Then(&out,
+                     [&settled, i](std::optional<Empty> e) { settled[i] = e; });
+  };
+
+  std::function<void()> unblock_rejecting = BlockWorker(rejecting);
+  std::function<void()> unblock_dropping = BlockWorker(dropping);
+  record(rejecting.Enqueue([]() {}), 0);
+  record(rejecting.Enqueue([]() {}), 1);  // Refused
+  record(dropping.Enqueue([]() {}), 2);   // Dropped
+  record(dropping.Enqueue([]() {}), 3);
+  unblock_rejecting();
+  unblock_dropping();
+
+  rejecting.Finish();
+  dropping.Finish();
+  rejecting.Join();
+  dropping.Join();
+  out.Finish();
+  out.Join();
+  EXPECT_TRUE(settled[0].has_value());
+  EXPECT_FALSE(settled[1].has_value());
+  EXPECT_FALSE(settled[2].has_value());
+  EXPECT_TRUE(settled[3].has_value());
+}
+
+TEST(EventQueueTest, BlocksCallersAtCapacity) {
+  EventQueue::Options options;
+  options.capacity = 2;
+  options.overflow_policy = EventQueue::OverflowPolicy::kBlock;
+  EventQueue q("", options);
+  std::atomic<int> ran(0);
+  std::atomic<int> enqueued(0);
+
+  std::function<void()> unblock = BlockWorker(q);
+  std::thread producer([&]() {
+    for (int i = 0; i < 3; i++) {
+      q.Enqueue([&ran]() { ran++; });
+      enqueued++;
+    }
+  });
+  while (enqueued.load() < 2) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ(enqueued.load(), 2);
+  unblock();
+  producer.join();
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(ran.load(), 3);
+  EXPECT_EQ(q.Dropped(), 0);
+}
+
+TEST(EventQueueTest, EnqueueBatchRunsTasksInOrder) {
+  EventQueue q;
+  std::vector<std::function<int()>> fs;
+  for (int i = 0; i < 10; i++) {
+    fs.push_back([i]() { return i; });
+  }
+  std::vector<int> results;
+
+  std::vector<Promise<int>> promises = q.EnqueueBatch(fs);
+  ASSERT_EQ(promises.size(), 10);
+  for (auto &p : promises) {
+    p.Then<Empty>(&q, [&results](int i) {
+      results.push_back(i);
+      return Empty();
+    });
+  }
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(results, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(EventQueueTest, EnqueueBatchLargerThanCapacityBlocks) {
+  EventQueue::Options options;
+  options.capacity = 2;
+  options.overflow_policy = EventQueue::OverflowPolicy::kBlock;
+  EventQueue q("", options);
+  std::string order;
+  std::vector<std::function<void()>> fs;
+  for (char c : std::string("abcde")) {
+    fs.push_back([&order, c]() { order += c; });
+  }
+
+  // The tasks that fit must reach the worker before the caller blocks, or
+  // there would never be room for the rest.
+  q.EnqueueBatch(fs);
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(order, "abcde");
+  EXPECT_EQ(q.Dropped(), 0);
+}
+
+TEST(EventQueueTest, AbandonedContinuationsDoNotKeepTheQueueAlive) {
+  EventQueue q;
+  {
+    auto pr = EventQueue::CreateResolver<int>();
+    pr.first.Then<int>(&q, [](int k) { return k; });
+  }
+  q.Finish();
+  q.Join();
+}
+
+TEST(EventQueueTest, WhenReadableResolvesOnceThereIsData) {
+  EventQueue::Options options;
+  options.reactor = true;
+  EventQueue q("", options);
+  int fds[2];
+  ASSERT_EQ(pipe2(fds, O_NONBLOCK), 0);
+  std::string received;
+
+  q.Enqueue([&]() {
+    q.WhenReadable(fds[0]).Then([&]() {
+      char buf[16];
+      ssize_t n = read(fds[0], buf, sizeof(buf));
+      received.assign(buf, n > 0 ? n : 0);
+    });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_EQ(write(fds[1], "hi", 2), 2);
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(received, "hi");
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Accept a connection on a loopback socket and echo what the client sends,
+// with the client in the same EventQueue, and no other threads.
+TEST(EventQueueTest, LoopbackEchoWithoutHelperThreads) {
+  EventQueue::Options options;
+  options.reactor = true;
+  EventQueue q("", options);
+
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  ASSERT_GE(listener, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(bind(listener, reinterpret_cast<sockaddr *>(&addr), len), 0);
+  ASSERT_EQ(getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len),
+            0);
+  ASSERT_EQ(listen(listener, 1), 0);
+  int client = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  ASSERT_GE(client, 0);
+  int server = -1;
+  std::string echoed;
+
+  q.Enqueue([&]() {
+    // A non-blocking connect completes once the socket is writable.
+    connect(client, reinterpret_cast<sockaddr *>(&addr), len);
+    q.WhenReadable(listener).Then([&]() {
+      server = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+      q.WhenReadable(server).Then([&]() {
+        char buf[16];
+        ssize_t n = read(server, buf, sizeof(buf));
+        write(server, buf, n);
+      });
+    });
+    q.WhenWritable(client).Then([&]() {
+      write(client, "ping", 4);
+      q.WhenReadable(client).Then([&]() {
+        char buf[16];
+        ssize_t n = read(client, buf, sizeof(buf));
+        echoed.assign(buf, n > 0 ? n : 0);
+      });
+    });
+  });
+
+  q.Finish();
+  q.Join();
+  EXPECT_EQ(echoed, "ping");
+  close(server);
+  close(client);
+  close(listener);
+}
+
+TEST(EventCountTest, NotifyWakesWaiter) {
+  EventCount ec;
+  std::atomic<bool> ready(false);
+  std::thread waiter([&]() {
+    while (!ready.load()) {
+      uint64_t key = ec.PrepareWait();
+      if (ready.load()) {
+        ec.CancelWait();
+      } else {
+        ec.Wait(key);
+      }
+    }
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  ready.store(true);
+  ec.Notify();
+  waiter.join();
+}
+
+TEST(EventCountTest, NotifyOneWakesEachWaiterInTurn) {
+  EventCount ec;
+  std::atomic<int> tokens(0);
+  std::atomic<int> woken(0);
+  auto take = [&]() {
+    int n = tokens.load();
+    while (n > 0 && !tokens.compare_exchange_weak(n, n - 1)) {
+    }
+    return n > 0;
+  };
+  std::vector<std::thread> waiters;
+  for (int i = 0; i < 3; i++) {
+    waiters.emplace_back([&]() {
+      while (!take()) {
+        uint64_t key = ec.PrepareWait();
+        if (tokens.load() > 0) {
+          ec.CancelWait();
+        } else {
+          ec.Wait(key);
+        }
+      }
+      woken++;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  for (int i = 0; i < 3; i++) {
+    tokens++;
+    ec.NotifyOne();
+  }
+  for (auto &t : waiters) {
+    t.join();
+  }
+  EXPECT_EQ(woken.load(), 3);
+}
+
+TEST(TaskFunctionTest, SmallCallableIsStoredInline) {
+  long before = allocation_count.load();
+  counting_allocations.store(true);
+  int calls = 0;
+  TaskFunction f([&calls]() { calls++; });
+  TaskFunction g(std::move(f));
+  g();
+  counting_allocations.store(false);
+  EXPECT_FALSE(f);
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(allocation_count.load(), before);
+}
+
+TEST(TaskFunctionTest, LargeCallable) {
+  struct Large {
+    char padding[2 * TaskFunction::kInlineSize];
+  };
+  int calls = 0;
+  TaskFunction f([&calls, large = Large()]() { calls++; });
+  TaskFunction g;
+  g = std::move(f);
+  g();
+  EXPECT_EQ(calls, 1);
+}
+
+TEST(TaskFunctionTest, MoveOnlyCallableIsDestroyed) {
+  auto counter = std::make_shared<int>(0);
+  {
+    TaskFunction f([p = std::make_unique<std::shared_ptr<int>>(counter)]() {
+      (**p)++;
+    });
+    f();
+    EXPECT_EQ(counter.use_count(), 2);
+  }
+  EXPECT_EQ(*counter, 1);
+  EXPECT_EQ(counter.use_count(), 1);
+}
+
+}  // namespace
+}  // namespace cpppromise
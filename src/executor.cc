@@ -0,0 +1,100 @@
+#include "executor.h"
+
+#include <algorithm>
+
+namespace cpppromise {
+
+namespace {
+
+// The Executor, if any, whose worker is the current thread, and which worker.
+thread_local Executor *current_executor = nullptr;
+thread_local int current_worker = -1;
+
+}  // namespace
+
+Executor::Executor(int num_threads)
+    : pending_(0), next_worker_(0), running_(true) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < num_threads; i++) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (int i = 0; i < num_threads; i++) {
+    workers_[i]->t = std::thread([this, i]() { Run(i); });
+  }
+}
+
+Executor::~Executor() {
+  running_.store(false);
+  idle_.Notify();
+  for (auto &worker : workers_) {
+    worker->t.join();
+  }
+}
+
+Executor *Executor::Current() { return current_executor; }
+
+void Executor::Submit(TaskFunction f) {
+  // Work submitted by a worker stays with that worker, where its caches are
+  // likely warm, unless someone else steals it.
+  int index = current_executor == this
+                  ? current_worker
+                  : next_worker_.fetch_add(1, std::memory_order_relaxed) %
+                        workers_.size();
+  {
+    std::unique_lock<std::mutex> lock(workers_[index]->mu);
+    workers_[index]->tasks.push_back(std::move(f));
+  }
+  pending_.fetch_add(1);
+  // One task needs one worker. A worker that wakes up looks for more work
+  // before sleeping again, so nothing is left behind if the notify reaches a
+  // worker that was already waking up.
+  idle_.NotifyOne();
+}
+
+TaskFunction Executor::Take(int index) {
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker &worker = *workers_[(index + i) % workers_.size()];
+    std::unique_lock<std::mutex> lock(worker.mu);
+    if (worker.tasks.empty()) {
+      continue;
+    }
+    TaskFunction f;
+    if (i == 0) {
+      f = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+    } else {
+      f = std::move(worker.tasks.back());
+      worker.tasks.pop_back();
+    }
+    pending_.fetch_sub(1);
+    return f;
+  }
+  return TaskFunction();
+}
+
+void Executor::Run(int index) {
+  current_executor = this;
+  current_worker = index;
+  while (true) {
+    if (TaskFunction f = Take(index)) {
+      f();
+      continue;
+    }
+    uint64_t key = idle_.PrepareWait();
+    if (pending_.load() > 0) {
+      idle_.CancelWait();
+      continue;
+    }
+    if (!running_.load()) {
+      idle_.CancelWait();
+      break;
+    }
+    idle_.Wait(key);
+  }
+  current_executor = nullptr;
+  current_worker = -1;
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "event_count.h"
+#include "task_function.h"
+
+namespace cpppromise {
+
+// An Executor is a fixed pool of worker threads that run the functions
+// submitted to it, in no particular order. Each worker has its own queue of
+// work, and an idle worker steals from the others.
+//
+// An EventQueue can run its tasks on an Executor instead of on a thread of its
+// own, by way of EventQueue::Options::executor. That way, any number of
+// EventQueues can share a few threads.
+class Executor {
+ public:
+  // Start an Executor with the given number of worker threads, or with one per
+  // CPU if num_threads is zero.
+  explicit Executor(int num_threads = 0);
+
+  // Wait for all the submitted work to be done, then stop the workers. Any
+  // EventQueue using this Executor must have been Joined already.
+  ~Executor();
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  // Arrange for f to be run on one of the worker threads. Safe to call from
+  // any thread.
+  void Submit(TaskFunction f);
+
+  int NumThreads() const { return workers_.size(); }
+
+  // Return the Executor that the calling thread is a worker of, or nullptr.
+  static Executor *Current();
+
+ private:
+  struct Worker {
+    std::mutex mu;
+    std::deque<TaskFunction> tasks;
+    std::thread t;
+  };
+
+  void Run(int index);
+  // Take a task from worker "index", or steal one from another worker.
+  TaskFunction Take(int index);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // The number of submitted tasks that have not yet been taken by a worker.
+  std::atomic<int> pending_;
+  std::atomic<unsigned> next_worker_;
+  std::atomic<bool> running_;
+  EventCount idle_;
+};
+
+}  // namespace cpppromise
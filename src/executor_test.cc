@@ -0,0 +1,256 @@
+#include "src/cpp_common/cpppromise/executor.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/cpp_common/cpppromise/cpppromise.h"
+
+namespace cpppromise {
+namespace {
+
+TEST(ExecutorTest, RunsEverySubmittedTask) {
+  std::atomic<int> ran(0);
+  {
+    Executor executor(4);
+    std::vector<std::thread> producers;
+    for (int i = 0; i < 4; i++) {
+      producers.push_back(std::thread([&]() {
+        for (int j = 0; j < 1000; j++) {
+          executor.Submit([&ran]() { ran++; });
+        }
+      }));
+    }
+    for (auto &t : producers) {
+      t.join();
+    }
+  }
+  EXPECT_EQ(ran.load(), 4000);
+}
+
+TEST(ExecutorTest, IdleWorkersStealWork) {
+  Executor executor(2);
+  std::atomic<bool> stolen(false);
+  std::atomic<bool> done(false);
+  executor.Submit([&]() {
+    EXPECT_EQ(Executor::Current(), &executor);
+    // This lands on our own worker, which is busy until someone else runs it.
+    executor.Submit([&]() { stolen = true; });
+    while (!stolen.load()) {
+      std::this_thread::yield();
+    }
+    done = true;
+  });
+  while (!done.load()) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(Executor::Current(), nullptr);
+}
+
+TEST(ExecutorTest, EventQueuesRunInOrderOneTaskAtATime) {
+  constexpr int kQueues = 100;
+  constexpr int kTasks = 100;
+  Executor executor(4);
+  EventQueue::Options options;
+  options.executor = &executor;
+
+  std::vector<std::unique_ptr<EventQueue>> queues;
+  for (int i = 0; i < kQueues; i++) {
+    queues.push_back(std::make_unique<EventQueue>("", options));
+  }
+  std::vector<int> next(kQueues, 0);
+  std::vector<std::atomic<bool>> busy(kQueues);
+  std::atomic<int> errors(0);
+  for (int j = 0; j < kTasks; j++) {
+    for (int i = 0; i < kQueues; i++) {
+      EventQueue *q = queues[i].get();
+      q->Enqueue([&, i, j, q]() {
+        if (busy[i].exchange(true) || EventQueue::Get() != q ||
+            next[i] != j) {
+          errors++;
+        }
+        next[i]++;
+        busy[i] = false;
+      });
+    }
+  }
+  for (auto &q : queues) {
+    q->Finish();
+  }
+  for (auto &q : queues) {
+    q->Join();
+  }
+  EXPECT_EQ(errors.load(), 0);
+  for (int i = 0; i < kQueues; i++) {
+    EXPECT_EQ(next[i], kTasks);
+  }
+}
+
+TEST(ExecutorTest, PromisesHopBetweenEventQueues) {
+  Executor executor(2);
+  EventQueue::Options options;
+  options.executor = &executor;
+  EventQueue q0("", options);
+  EventQueue q1("", options);
+
+  auto pr = EventQueue::CreateResolver<int>();
+  Promise<int> p = pr.first;
+  for (int i = 0; i < 1000; i++) {
+    p = p.Then<int>(i % 2 == 0 ? &q0 : &q1, [](int k) { return k + 1; });
+  }
+  std::atomic<int> result(0);
+  p.Then<Empty>(&q0, [&result](int k) {
+    result = k;
+    return Empty();
+  });
+  pr.second.Resolve(0);
+
+  q0.Finish();
+  q1.Finish();
+  q0.Join();
+  q1.Join();
+  EXPECT_EQ(result.load(), 1000);
+}
+
+class Counter : public Process {
+ public:
+  Promise<int> Add(int n) {
+    return Enqueue<int>([this, n]() {
+      on_executor_ = Executor::Current() != nullptr;
+      total_ += n;
+      return total_;
+    });
+  }
+
+  bool on_executor() const { return on_executor_; }
+
+  void Stop() { Finish(); }
+
+ private:
+  int total_ = 0;
+  bool on_executor_ = false;
+};
+
+TEST(ExecutorTest, ProcessesOptInThroughTheDefaultOptions) {
+  Executor executor(2);
+  EventQueue::Options saved = EventQueue::GetDefaultOptions();
+  EventQueue::Options options = saved;
+  options.executor = &executor;
+  EventQueue::SetDefaultOptions(options);
+
+  Counter counter;
+  EventQueue::SetDefaultOptions(saved);
+
+  for (int i = 1; i <= 10; i++) {
+    counter.Add(i);
+  }
+  std::atomic<int> total(0);
+  EventQueue q;
+  counter.Add(0).Then<Empty>(&q, [&](int t) {
+    total = t;
+    q.Finish();
+    return Empty();
+  });
+  q.Join();
+  counter.Stop();
+  counter.Join();
+  EXPECT_EQ(total.load(), 55);
+  EXPECT_TRUE(counter.on_executor());
+}
+
+TEST(ExecutorTest, ParallelForRunsEveryIndexOnceAndCallsBack) {
+  constexpr int kSize = 10000;
+  Executor executor(4);
+  EventQueue q;
+  std::vector<std::atomic<int>> runs(kSize);
+  bool called_back_in_q = false;
+  ParallelFor(&executor, 0, kSize, [&runs](size_t i) { runs[i]++; })
+      .Then(&q, [&]() {
+        called_back_in_q = EventQueue::Get() == &q;
+        q.Finish();
+      });
+  q.Join();
+  EXPECT_TRUE(called_back_in_q);
+  for (int i = 0; i < kSize; i++) {
+    EXPECT_EQ(runs[i].load(), 1);
+  }
+}
+
+TEST(ExecutorTest, ParallelMapKeepsItsResultsInOrder) {
+  Executor executor(4);
+  EventQueue q;
+  std::vector<int> input;
+  std::vector<long> expected;
+  for (int i = 0; i < 10000; i++) {
+    input.push_back(i);
+    expected.push_back(long(i) * i);
+  }
+  std::vector<long> squares;
+  ParallelMap(&executor, input, [](int k) { return long(k) * k; }, 7)
+      .Then(&q, [&](std::vector<long> v) {
+        squares = std::move(v);
+        q.Finish();
+      });
+  q.Join();
+  EXPECT_EQ(squares, expected);
+}
+
+TEST(ExecutorTest, ParallelMapToBool) {
+  Executor executor(4);
+  EventQueue q;
+  std::vector<int> input;
+  std::vector<bool> expected;
+  for (int i = 0; i < 10000; i++) {
+    input.push_back(i);
+    expected.push_back(i % 3 == 0);
+  }
+  // Chunks of one element, so that neighbouring bits are written by different
+  // workers.
+  std::vector<bool> multiples;
+  ParallelMap(&executor, input, [](int k) { return k % 3 == 0; }, 1)
+      .Then(&q, [&](std::vector<bool> v) {
+        multiples = std::move(v);
+        q.Finish();
+      });
+  q.Join();
+  EXPECT_EQ(multiples, expected);
+}
+
+TEST(ExecutorTest, ParallelReduceCombinesItsChunksInOrder) {
+  Executor executor(4);
+  EventQueue q;
+  std::vector<std::string> letters;
+  std::string expected;
+  std::vector<int> numbers;
+  for (int i = 0; i < 1000; i++) {
+    letters.push_back(std::string(1, 'a' + i % 26));
+    expected += letters.back();
+    numbers.push_back(i);
+  }
+  // Concatenation is not commutative, so the chunks must be combined in order.
+  std::string text;
+  long sum = 0;
+  std::vector<int> none;
+  int nothing = -1;
+  auto concatenate = [](std::string a, const std::string &b) { return a + b; };
+  auto add = [](long total, int k) { return total + k; };
+  auto done = WhenAll(std::vector<Promise<Empty>>{
+      ParallelReduce(&executor, letters, std::string(), concatenate, 3)
+          .Then(&q, [&text](std::string s) { text = s; }),
+      ParallelReduce(&executor, numbers, 0L, add, std::plus<long>())
+          .Then(&q, [&sum](long s) { sum = s; }),
+      ParallelReduce(&executor, none, 0, std::plus<int>())
+          .Then(&q, [&nothing](int s) { nothing = s; })});
+  done.Then(&q, [&q](std::vector<Empty>) { q.Finish(); });
+  q.Join();
+  EXPECT_EQ(text, expected);
+  EXPECT_EQ(sum, 999 * 1000 / 2);
+  EXPECT_EQ(nothing, 0);
+}
+
+}  // namespace
+}  // namespace cpppromise
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace cpppromise {
+
+// A FreeListPool recycles blocks of kSize bytes instead of returning them to
+// the heap, so that objects that are created and destroyed at a high rate, such
+// as tasks and PromiseControlBlocks, do not allocate in the steady state.
+//
+// Freed blocks are kept in a per-thread cache. When the cache is full, they go
+// onto a shared stack instead. A thread whose cache is empty takes the whole
+// shared stack at once, which avoids the ABA problem that popping single nodes
+// off a lock-free stack would have. So memory freed by one thread, say the
+// worker of an EventQueue, finds its way back to the thread that allocates it.
+//
+// The shared stack holds at most kSharedBytes worth of blocks, which is plenty
+// for tens of thousands of tasks in flight; beyond that, freed blocks go back
+// to the heap, so a burst of objects does not pin its peak memory for good.
+// Since a thread takes the whole shared stack, its cache may hold up to that
+// many blocks, but it then frees to the shared stack until it is back under
+// kCacheSize.
+template <std::size_t kSize>
+class FreeListPool {
+ public:
+  static void *Allocate();
+  static void Free(void *p);
+
+ private:
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  struct Cache {
+    ~Cache();
+
+    FreeBlock *head = nullptr;
+    int size = 0;
+  };
+
+  static constexpr int kCacheSize = 256;
+  static constexpr std::size_t kSharedBytes = 8 << 20;
+  static constexpr int kSharedSize =
+      std::max<int>(kCacheSize, kSharedBytes / kSize);
+
+  static void PushShared(FreeBlock *block);
+
+  static inline std::atomic<FreeBlock *> shared_{nullptr};
+  // At least the number of blocks on shared_: it is raised before a block is
+  // pushed, and lowered after the blocks are taken.
+  static inline std::atomic<int> shared_size_{0};
+  static inline thread_local Cache cache_;
+};
+
+template <std::size_t kSize>
+FreeListPool<kSize>::Cache::~Cache() {
+  while (head != nullptr) {
+    FreeBlock *block = head;
+    head = head->next;
+    PushShared(block);
+  }
+}
+
+template <std::size_t kSize>
+void FreeListPool<kSize>::PushShared(FreeBlock *block) {
+  // Racing threads may overshoot the limit a little, which does no harm.
+  if (shared_size_.load(std::memory_order_relaxed) >= kSharedSize) {
+    ::operator delete(block);
+    return;
+  }
+  shared_size_.fetch_add(1, std::memory_order_relaxed);
+  block->next = shared_.load(std::memory_order_relaxed);
+  while (!shared_.compare_exchange_weak(block->next, block,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+  }
+}
+
+template <std::size_t kSize>
+void *FreeListPool<kSize>::Allocate() {
+  if (cache_.head == nullptr) {
+    FreeBlock *taken = shared_.exchange(nullptr, std::memory_order_acquire);
+    if (taken == nullptr) {
+      return ::operator new(kSize);
+    }
+    int n = 0;
+    for (FreeBlock *block = taken; block != nullptr; block = block->next) {
+      n++;
+    }
+    shared_size_.fetch_sub(n, std::memory_order_relaxed);
+    cache_.head = taken;
+    cache_.size = n;
+  }
+  FreeBlock *block = cache_.head;
+  cache_.head = block->next;
+  cache_.size--;
+  return block;
+}
+
+template <std::size_t kSize>
+void FreeListPool<kSize>::Free(void *p) {
+  FreeBlock *block = static_cast<FreeBlock *>(p);
+  if (cache_.size < kCacheSize) {
+    block->next = cache_.head;
+    cache_.head = block;
+    cache_.size++;
+  } else {
+    PushShared(block);
+  }
+}
+
+// An allocator that takes single objects from a FreeListPool, for use with
+// std::allocate_shared. Types of similar sizes share a pool.
+template <typename T>
+class PoolAllocator {
+ public:
+  using value_type = T;
+
+  PoolAllocator() = default;
+
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    if (n != 1) {
+      return std::allocator<T>().allocate(n);
+    }
+    return static_cast<T *>(Pool::Allocate());
+  }
+
+  void deallocate(T *p, std::size_t n) {
+    if (n != 1) {
+      std::allocator<T>().deallocate(p, n);
+      return;
+    }
+    Pool::Free(p);
+  }
+
+  template <typename U>
+  bool operator==(const PoolAllocator<U> &) const {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const PoolAllocator<U> &) const {
+    return false;
+  }
+
+ private:
+  static_assert(alignof(T) <= alignof(std::max_align_t));
+
+  using Pool = FreeListPool<(sizeof(T) + 15) / 16 * 16>;
+};
+
+}  // namespace cpppromise
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+
+namespace cpppromise {
+
+// Intrusive hook for elements of an MpscQueue. An element may be in at most one
+// MpscQueue at a time.
+struct MpscNode {
+  std::atomic<MpscNode *> next{nullptr};
+};
+
+// An MpscQueue is an intrusive, unbounded, lock-free FIFO queue that admits any
+// number of concurrent producers but only one consumer. A producer publishes an
+// element with a single atomic exchange and never waits for anyone; the
+// consumer never waits for producers either. The queue does not own its
+// elements, which must derive from MpscNode.
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue();
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  // Append an element. Safe to call from any thread.
+  void Push(T *node);
+
+  // Append the elements from first to last, which the caller has already linked
+  // through their next pointers, with a single atomic exchange. Safe to call
+  // from any thread.
+  void PushChain(T *first, T *last);
+
+  // Remove and return the oldest element, or nullptr if there is none. May only
+  // be called by the consumer. Pop can return nullptr while some Push is half
+  // way done, even though the queue is then not Empty.
+  T *Pop();
+
+  // Return true if there are no elements in the queue, counting those whose
+  // Push is still in progress. May only be called by the consumer.
+  bool Empty() const;
+
+ private:
+  void PushNode(MpscNode *node);
+  void PushNodes(MpscNode *first, MpscNode *last);
+
+  // Producers append at head_; the consumer removes at tail_. The queue always
+  // contains at least one node, using stub_ when it would otherwise be empty.
+  std::atomic<MpscNode *> head_;
+  MpscNode *tail_;
+  MpscNode stub_;
+};
+
+}  // namespace cpppromise
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "mpsc_queue.h"
+
+namespace cpppromise {
+
+template <typename T>
+MpscQueue<T>::MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+template <typename T>
+void MpscQueue<T>::Push(T *node) {
+  PushNode(node);
+}
+
+template <typename T>
+void MpscQueue<T>::PushChain(T *first, T *last) {
+  PushNodes(first, last);
+}
+
+template <typename T>
+void MpscQueue<T>::PushNode(MpscNode *node) {
+  PushNodes(node, node);
+}
+
+template <typename T>
+void MpscQueue<T>::PushNodes(MpscNode *first, MpscNode *last) {
+  last->next.store(nullptr, std::memory_order_relaxed);
+  MpscNode *prev = head_.exchange(last, std::memory_order_acq_rel);
+  // Between the exchange and this store, the consumer cannot see past prev.
+  prev->next.store(first, std::memory_order_release);
+}
+
+template <typename T>
+T *MpscQueue<T>::Pop() {
+  MpscNode *tail = tail_;
+  MpscNode *next = tail->next.load(std::memory_order_acquire);
+  if (tail == &stub_) {
+    if (next == nullptr) {
+      return nullptr;
+    }
+    tail_ = next;
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next != nullptr) {
+    tail_ = next;
+    return static_cast<T *>(tail);
+  }
+  if (tail != head_.load(std::memory_order_acquire)) {
+    // A producer has claimed the head but not yet linked it in.
+    return nullptr;
+  }
+  // tail is the last element. Put the stub behind it so we can unlink it.
+  PushNode(&stub_);
+  next = tail->next.load(std::memory_order_acquire);
+  if (next != nullptr) {
+    tail_ = next;
+    return static_cast<T *>(tail);
+  }
+  return nullptr;
+}
+
+template <typename T>
+bool MpscQueue<T>::Empty() const {
+  return tail_ == &stub_ && head_.load(std::memory_order_acquire) == &stub_;
+}
+
+}  // namespace cpppromise
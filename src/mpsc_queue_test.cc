@@ -0,0 +1,114 @@
+#include "src/cpp_common/cpppromise/mpsc_queue.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "src/cpp_common/cpppromise/mpsc_queue_impl.h"
+
+namespace cpppromise {
+namespace {
+
+struct Item : public MpscNode {
+  int producer;
+  int value;
+};
+
+TEST(MpscQueueTest, EmptyQueue) {
+  MpscQueue<Item> q;
+  EXPECT_TRUE(q.Empty());
+  EXPECT_EQ(q.Pop(), nullptr);
+  EXPECT_TRUE(q.Empty());
+}
+
+TEST(MpscQueueTest, FifoOrder) {
+  MpscQueue<Item> q;
+  std::vector<Item> items(100);
+  for (int i = 0; i < 3; i++) {
+    // Go around several times to exercise the reuse of the stub node.
+    for (size_t j = 0; j < items.size(); j++) {
+      items[j].value = static_cast<int>(j);
+      q.Push(&items[j]);
+      EXPECT_FALSE(q.Empty());
+    }
+    for (size_t j = 0; j < items.size(); j++) {
+      Item *item = q.Pop();
+      ASSERT_NE(item, nullptr);
+      EXPECT_EQ(item->value, static_cast<int>(j));
+    }
+    EXPECT_TRUE(q.Empty());
+    EXPECT_EQ(q.Pop(), nullptr);
+  }
+}
+
+TEST(MpscQueueTest, InterleavedPushAndPop) {
+  MpscQueue<Item> q;
+  Item a, b;
+  q.Push(&a);
+  EXPECT_EQ(q.Pop(), &a);
+  q.Push(&b);
+  q.Push(&a);
+  EXPECT_EQ(q.Pop(), &b);
+  EXPECT_FALSE(q.Empty());
+  EXPECT_EQ(q.Pop(), &a);
+  EXPECT_TRUE(q.Empty());
+}
+
+TEST(MpscQueueTest, PushChain) {
+  MpscQueue<Item> q;
+  std::vector<Item> items(5);
+  for (size_t i = 0; i < items.size(); i++) {
+    items[i].value = static_cast<int>(i);
+  }
+  q.Push(&items[0]);
+  for (int i = 1; i < 3; i++) {
+    items[i].next.store(&items[i + 1]);
+  }
+  q.PushChain(&items[1], &items[3]);
+  q.Push(&items[4]);
+  for (size_t i = 0; i < items.size(); i++) {
+    Item *item = q.Pop();
+    ASSERT_NE(item, nullptr);
+    EXPECT_EQ(item->value, static_cast<int>(i));
+  }
+  EXPECT_TRUE(q.Empty());
+}
+
+TEST(MpscQueueTest, ManyProducers) {
+  constexpr int kProducers = 8;
+  constexpr int kItemsPerProducer = 100000;
+  MpscQueue<Item> q;
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.push_back(std::thread([&q, p]() {
+      for (int i = 0; i < kItemsPerProducer; i++) {
+        q.Push(new Item{{}, p, i});
+      }
+    }));
+  }
+
+  // Each producer's items must come out in the order that producer pushed
+  // them, and none may be lost.
+  std::vector<int> next(kProducers, 0);
+  int received = 0;
+  while (received < kProducers * kItemsPerProducer) {
+    std::unique_ptr<Item> item(q.Pop());
+    if (!item) {
+      std::this_thread::yield();
+      continue;
+    }
+    ASSERT_EQ(item->value, next[item->producer]);
+    next[item->producer]++;
+    received++;
+  }
+
+  for (auto &t : producers) {
+    t.join();
+  }
+  EXPECT_TRUE(q.Empty());
+}
+
+}  // namespace
+}  // namespace cpppromise
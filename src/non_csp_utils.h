@@ -3,42 +3,103 @@
 #pragma once
 
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
 
 #include "src/cpp_common/cpppromise/cpppromise.h"
 #include "src/cpp_common/cpppromise/cpppromise_stream.h"
+#include "src/cpp_common/cpppromise/free_list_pool.h"
 
 // This header contains helper functions to interact with CSP thread from
 // non-csp thread and should NEVER be used between two csp threads.
 namespace cpppromise {
 
-// Helper function to get promise result in the non-csp thread
+// What a thread waiting in Get shares with the dependent that hands it the
+// result. The dependent may outlive the wait, if GetFor gives up first.
+template <typename T>
+struct GetState {
+  // Start waiting for promise, whose result, or the lack of one if it is
+  // cancelled, is handed over in whichever thread settles it.
+  static std::shared_ptr<GetState> Start(const Promise<T> &promise) {
+    auto state = std::allocate_shared<GetState>(PoolAllocator<GetState>());
+    PromiseInternal::OnResult(promise, [state](T *result) {
+      std::lock_guard<std::mutex> lock(state->mu);
+      if (result) {
+        state->result.emplace(std::move(*result));
+      }
+      state->settled = true;
+      state->cv.notify_one();
+    });
+    return state;
+  }
+
+  std::mutex mu;
+  std::condition_variable cv;
+  // Guarded by mu.
+  bool settled = false;
+  std::optional<T> result;
+};
+
+// Helper function to get promise result in the non-csp thread. The calling
+// thread waits on a condition variable of its own until the promise is
+// resolved, so no thread is started. If the promise is cancelled instead, there
+// is no result to return, and Get aborts the program, in every build mode; Get
+// its Settled(), or use GetFor, if it may be cancelled.
 template <typename T>
 T Get(Promise<T> promise) {
   // Ensure this is never called from a CSP thread
   assert(EventQueue::Get() == nullptr);
-  EventQueue q;
-  T ret;
-
-  q.Enqueue([&]() { promise.template Then([&](T res) { ret = res; }); });
+  auto state = GetState<T>::Start(promise);
+  std::unique_lock<std::mutex> lock(state->mu);
+  state->cv.wait(lock, [&state] { return state->settled; });
+  if (!state->result.has_value()) {
+    std::abort();
+  }
+  return std::move(*state->result);
+}
 
-  q.Finish();
-  q.Join();
+// Like Get, but give up after timeout. Return std::nullopt if the promise is
+// not resolved by then, or is cancelled.
+template <typename T>
+std::optional<T> GetFor(Promise<T> promise, std::chrono::nanoseconds timeout) {
+  // Ensure this is never called from a CSP thread
+  assert(EventQueue::Get() == nullptr);
+  auto state = GetState<T>::Start(promise);
+  std::unique_lock<std::mutex> lock(state->mu);
+  if (!state->cv.wait_for(lock, timeout,
+                          [&state] { return state->settled; })) {
+    return std::nullopt;
+  }
+  return std::move(state->result);
+}
 
-  return ret;
+// Get the results of all of the promises, in order, with a single wait. Like
+// Get, aborts if any of them is cancelled.
+template <typename T>
+std::vector<T> GetAll(std::vector<Promise<T>> promises) {
+  return Get(WhenAll(std::move(promises)));
 }
 
+// Like Get, for the promise returned by async_func. Since async_func may call
+// Then without naming an EventQueue, it is run in an EventQueue of its own,
+// which does start a thread; prefer Get(promise) where possible.
 template <typename T>
 T Get(std::function<Promise<T>()> async_func) {
   // Ensure this is never called from a CSP thread
   assert(EventQueue::Get() == nullptr);
   EventQueue q;
-  T ret;
-
-  q.Enqueue([&]() { async_func().template Then([&](T res) { ret = res; }); });
-
+  Promise<T> promise = q.Enqueue<Promise<T>>(async_func).Then(
+      &q, [](Promise<T> p) { return p; });
   q.Finish();
+  T ret = Get(promise);
   q.Join();
-
   return ret;
 }
 
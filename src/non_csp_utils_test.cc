@@ -1,5 +1,9 @@
 #include "src/cpp_common/cpppromise/non_csp_utils.h"
 
+#include <chrono>
+#include <optional>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 namespace cpppromise {
@@ -36,6 +40,50 @@ TEST(NonCSPUtilsTest, GetAsyncFunc) {
   q.Join();
 }
 
+// Has no default constructor, which Get used to need.
+struct Meters {
+  explicit Meters(int n) : n(n) {}
+  int n;
+};
+
+TEST(NonCSPUtilsTest, GetForAndGetAll) {
+  EventQueue q;
+  auto never = EventQueue::CreateResolver<Meters>();
+  auto cancelled = EventQueue::CreateResolver<Meters>();
+  cancelled.second.Cancel();
+
+  ASSERT_EQ(Get(q.Enqueue<Meters>([]() { return Meters(3); })).n, 3);
+  std::optional<Meters> in_time = GetFor(
+      q.Enqueue<Meters>([]() { return Meters(4); }), std::chrono::hours(1));
+  ASSERT_TRUE(in_time.has_value());
+  ASSERT_EQ(in_time->n, 4);
+  ASSERT_FALSE(GetFor(never.first, std::chrono::milliseconds(1)).has_value());
+  ASSERT_FALSE(GetFor(cancelled.first, std::chrono::hours(1)).has_value());
+  // The dependent left behind by the GetFor that gave up is still safe to run.
+  never.second.Resolve(Meters(5));
+
+  std::vector<Promise<int>> promises;
+  for (int i = 0; i < 10; i++) {
+    promises.push_back(q.Enqueue<int>([i]() { return i * i; }));
+  }
+  std::vector<int> squares = GetAll(promises);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(squares[i], i * i);
+  }
+
+  q.Finish();
+  q.Join();
+}
+
+TEST(NonCSPUtilsTest, GetAbortsOnACancelledPromise) {
+  // Earlier tests leave the Timer's thread running.
+  GTEST_FLAG_SET(death_test_style, "threadsafe");
+  auto cancelled = EventQueue::CreateResolver<int>();
+  cancelled.second.Cancel();
+  ASSERT_DEATH(Get(cancelled.first), "");
+  ASSERT_EQ(Get(cancelled.first.Settled()), std::nullopt);
+}
+
 TEST(NonCSPUtilsTest, SubscribeAndWait) {
   EventQueue q;
 
@@ -0,0 +1,76 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace cpppromise {
+
+namespace {
+
+// How many chunks of grain elements each worker gets, if no grain is given.
+constexpr size_t kChunksPerWorker = 32;
+
+}  // namespace
+
+void ParallelLoop::Start(Executor *executor, size_t begin, size_t end,
+                         size_t grain, Body body, TaskFunction done) {
+  if (begin >= end) {
+    done();
+    return;
+  }
+  size_t n = end - begin;
+  size_t threads = executor->NumThreads();
+  if (grain == 0) {
+    grain = std::max<size_t>(1, n / (threads * kChunksPerWorker));
+  }
+  // No point starting more workers than there are chunks for.
+  int workers = std::min(threads, (n + grain - 1) / grain);
+  auto *loop = new ParallelLoop(begin, end, grain, workers, std::move(body),
+                                std::move(done));
+  for (int i = 0; i < workers; i++) {
+    executor->Submit([loop]() { loop->Run(); });
+  }
+}
+
+ParallelLoop::ParallelLoop(size_t begin, size_t end, size_t grain, int workers,
+                           Body body, TaskFunction done)
+    : next_(begin),
+      end_(end),
+      grain_(grain),
+      workers_(workers),
+      running_(workers),
+      body_(std::move(body)),
+      done_(std::move(done)) {}
+
+bool ParallelLoop::Claim(size_t *begin, size_t *end) {
+  size_t next = next_.load(std::memory_order_relaxed);
+  size_t claimed;
+  do {
+    if (next >= end_) {
+      return false;
+    }
+    // Take half of an even share of what is left, so that the chunks shrink
+    // geometrically, and the last ones are grain_ long.
+    size_t size = std::max(grain_, (end_ - next) / (2 * workers_));
+    claimed = std::min(end_, next + size);
+  } while (!next_.compare_exchange_weak(next, claimed,
+                                        std::memory_order_relaxed));
+  *begin = next;
+  *end = claimed;
+  return true;
+}
+
+void ParallelLoop::Run() {
+  size_t begin, end;
+  while (Claim(&begin, &end)) {
+    body_(begin, end);
+  }
+  // The last worker through publishes what the others did, by way of the
+  // acquire-release on running_.
+  if (running_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    done_();
+    delete this;
+  }
+}
+
+}  // namespace cpppromise
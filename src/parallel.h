@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "empty.h"
+#include "executor.h"
+#include "promise.h"
+#include "task_function.h"
+
+namespace cpppromise {
+
+// Parallel loops over the workers of an Executor. Each one returns a Promise
+// that is resolved once the whole loop is done, so the caller carries on with
+// Then, in its own EventQueue, instead of waiting.
+//
+// The range is split into chunks as it goes: each worker claims a slice of
+// what is left that shrinks as the loop nears its end, but never below grain
+// elements. Early chunks are big, so there are few of them to claim, and the
+// last ones are small, so the workers finish at about the same time even when
+// some elements take longer than others. A grain of zero picks one that makes
+// a few dozen chunks per worker.
+//
+// The functions passed in are called by many workers at once, through a const
+// reference, so they must be safe to call concurrently.
+
+// Call f(i) for every i in [begin, end).
+template <typename F>
+Promise<Empty> ParallelFor(Executor *executor, size_t begin, size_t end, F f,
+                           size_t grain = 0, std::string id = "");
+
+// Return a Promise of a vector holding f(x) for every x in input, in order.
+template <typename T, typename F,
+          typename R = std::decay_t<std::invoke_result_t<const F &, const T &>>>
+Promise<std::vector<R>> ParallelMap(Executor *executor, std::vector<T> input,
+                                    F f, size_t grain = 0, std::string id = "");
+
+// Return a Promise of the elements of input folded into identity: each chunk
+// starts from identity and folds its elements in with accumulate(R, const T &),
+// and the results of the chunks are then folded together, in order, with
+// combine(R, R). Both must be associative, and identity must be an identity of
+// combine, but neither needs to be commutative.
+template <typename T, typename R, typename F, typename C,
+          typename = std::enable_if_t<std::is_invocable_v<const C &, R, R>>>
+Promise<R> ParallelReduce(Executor *executor, std::vector<T> input, R identity,
+                          F accumulate, C combine, size_t grain = 0,
+                          std::string id = "");
+
+// Like the above, with op both accumulating and combining.
+template <typename T, typename F>
+Promise<T> ParallelReduce(Executor *executor, std::vector<T> input, T identity,
+                          F op, size_t grain = 0, std::string id = "");
+
+// Run body over the chunks of [begin, end), on the workers of an Executor, and
+// done once they are all through. Used by ParallelFor and friends.
+class ParallelLoop {
+ public:
+  using Body = InlineFunction<void(size_t begin, size_t end)>;
+
+  // Start running body, which is called by many workers at once. The
+  // ParallelLoop deletes itself once done has been run.
+  static void Start(Executor *executor, size_t begin, size_t end, size_t grain,
+                    Body body, TaskFunction done);
+
+ private:
+  ParallelLoop(size_t begin, size_t end, size_t grain, int workers, Body body,
+               TaskFunction done);
+
+  // Claim the next chunk, and return false if there is none left.
+  bool Claim(size_t *begin, size_t *end);
+  // Run chunks until there are none left.
+  void Run();
+
+  std::atomic<size_t> next_;
+  const size_t end_;
+  const size_t grain_;
+  const int workers_;
+  // How many of the workers that were started are not through yet.
+  std::atomic<int> running_;
+  Body body_;
+  TaskFunction done_;
+};
+
+}  // namespace cpppromise
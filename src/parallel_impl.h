@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "event_queue.h"
+#include "parallel.h"
+#include "resolver.h"
+
+namespace cpppromise {
+
+template <typename F>
+Promise<Empty> ParallelFor(Executor *executor, size_t begin, size_t end, F f,
+                           size_t grain, std::string id) {
+  auto pair = EventQueue::CreateResolver<Empty>(std::move(id));
+  ParallelLoop::Start(
+      executor, begin, end, grain,
+      [f = std::move(f)](size_t chunk_begin, size_t chunk_end) {
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+          f(i);
+        }
+      },
+      [resolver = std::move(pair.second)]() mutable {
+        resolver.Resolve(Empty());
+      });
+  return pair.first;
+}
+
+// The input and output of a ParallelMap. The loop body only needs a pointer
+// to it; the task that resolves the result owns it. Each result has a slot of
+// its own, since chunks on different workers write next to each other, and the
+// elements of a std::vector<bool> share words.
+template <typename T, typename F, typename R>
+struct ParallelMapState {
+  ParallelMapState(std::vector<T> input, F f, Resolver<std::vector<R>> resolver)
+      : input(std::move(input)),
+        output(this->input.size()),
+        f(std::move(f)),
+        resolver(std::move(resolver)) {}
+
+  const std::vector<T> input;
+  std::vector<std::optional<R>> output;
+  const F f;
+  Resolver<std::vector<R>> resolver;
+};
+
+template <typename T, typename F, typename R>
+Promise<std::vector<R>> ParallelMap(Executor *executor, std::vector<T> input,
+                                    F f, size_t grain, std::string id) {
+  auto pair = EventQueue::CreateResolver<std::vector<R>>(std::move(id));
+  size_t n = input.size();
+  auto state = std::make_shared<ParallelMapState<T, F, R>>(
+      std::move(input), std::move(f), std::move(pair.second));
+  ParallelLoop::Start(
+      executor, 0, n, grain,
+      [state = state.get()](size_t chunk_begin, size_t chunk_end) {
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+          state->output[i].emplace(state->f(state->input[i]));
+        }
+      },
+      [state]() {
+        std::vector<R> output;
+        output.reserve(state->output.size());
+        for (std::optional<R> &value : state->output) {
+          output.push_back(std::move(*value));
+        }
+        state->resolver.Resolve(std::move(output));
+      });
+  return pair.first;
+}
+
+// The input of a ParallelReduce, and the results of its chunks, keyed by where
+// they begin, so that they can be combined in order.
+template <typename T, typename R, typename F, typename C>
+struct ParallelReduceState {
+  ParallelReduceState(std::vector<T> input, R identity, F accumulate,
+                      C combine, Resolver<R> resolver)
+      : input(std::move(input)),
+        identity(std::move(identity)),
+        accumulate(std::move(accumulate)),
+        combine(std::move(combine)),
+        resolver(std::move(resolver)) {}
+
+  const std::vector<T> input;
+  const R identity;
+  const F accumulate;
+  const C combine;
+  Resolver<R> resolver;
+  std::mutex mu;
+  // Guarded by mu.
+  std::vector<std::pair<size_t, R>> partials;
+};
+
+template <typename T, typename R, typename F, typename C, typename>
+Promise<R> ParallelReduce(Executor *executor, std::vector<T> input, R identity,
+                          F accumulate, C combine, size_t grain,
+                          std::string id) {
+  auto pair = EventQueue::CreateResolver<R>(std::move(id));
+  size_t n = input.size();
+  auto state = std::make_shared<ParallelReduceState<T, R, F, C>>(
+      std::move(input), std::move(identity), std::move(accumulate),
+      std::move(combine), std::move(pair.second));
+  ParallelLoop::Start(
+      executor, 0, n, grain,
+      [state = state.get()](size_t chunk_begin, size_t chunk_end) {
+        R partial = state->identity;
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+          partial = state->accumulate(std::move(partial), state->input[i]);
+        }
+        std::lock_guard<std::mutex> lock(state->mu);
+        state->partials.emplace_back(chunk_begin, std::move(partial));
+      },
+      [state]() {
+        auto &partials = state->partials;
+        std::sort(partials.begin(), partials.end(),
+                  [](const std::pair<size_t, R> &a,
+                     const std::pair<size_t, R> &b) {
+                    return a.first < b.first;
+                  });
+        R result = state->identity;
+        for (auto &partial : partials) {
+          result = state->combine(std::move(result), std::move(partial.second));
+        }
+        state->resolver.Resolve(std::move(result));
+      });
+  return pair.first;
+}
+
+template <typename T, typename F>
+Promise<T> ParallelReduce(Executor *executor, std::vector<T> input, T identity,
+                          F op, size_t grain, std::string id) {
+  return ParallelReduce(executor, std::move(input), std::move(identity), op, op,
+                        grain, std::move(id));
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "promise.h"
+
+namespace cpppromise {
+
+// A Pipeline is a callable that runs a series of stages one after the other,
+// passing what each returns to the next one, and returns what the last one
+// returns. Its stages are fixed at compile time, so the compiler can inline
+// them into one another. Make one with Pipe.
+template <typename... Fs>
+class Pipeline {
+ public:
+  static_assert(sizeof...(Fs) > 0, "A Pipeline needs at least one stage");
+
+  explicit Pipeline(Fs... stages) : stages_(std::move(stages)...) {}
+
+  template <typename... Args>
+  decltype(auto) operator()(Args &&...args) {
+    return Run<0>(std::forward<Args>(args)...);
+  }
+
+ private:
+  // Run stage I and the ones after it, with args, or with nothing if stage I
+  // takes nothing, the way Promise::Then calls its continuation.
+  template <std::size_t I, typename... Args>
+  decltype(auto) Run(Args &&...args) {
+    auto &stage = std::get<I>(stages_);
+    if constexpr (I + 1 == sizeof...(Fs)) {
+      return Call(stage, std::forward<Args>(args)...);
+    } else {
+      using R = decltype(Call(stage, std::forward<Args>(args)...));
+      static_assert(!IsPromise<std::decay_t<R>>::value,
+                    "Only the last stage of a Pipeline can return a Promise; "
+                    "split the Pipeline into two Thens there instead");
+      if constexpr (std::is_void_v<R>) {
+        Call(stage, std::forward<Args>(args)...);
+        return Run<I + 1>();
+      } else {
+        return Run<I + 1>(Call(stage, std::forward<Args>(args)...));
+      }
+    }
+  }
+
+  template <typename F, typename... Args>
+  static decltype(auto) Call(F &f, Args &&...args) {
+    if constexpr (std::is_invocable_v<F &, Args...>) {
+      return std::invoke(f, std::forward<Args>(args)...);
+    } else {
+      return std::invoke(f);
+    }
+  }
+
+  std::tuple<Fs...> stages_;
+};
+
+// Return a Pipeline of stages, which fuses a chain of continuations that run
+// in the same EventQueue into one. Where
+//
+//   p.Then(q, a).Then(q, b).Then(q, c)
+//
+// takes three tasks and three Promises, of which the first two are only there
+// to pass values from one continuation to the next,
+//
+//   p.Then(q, Pipe(a, b, c))
+//
+// takes one of each, and computes the same result. The chain only needs a Then
+// where it moves to another EventQueue. A stage can take the result of the one
+// before it, or nothing, and return nothing; only the last one can return a
+// Promise.
+template <typename... Fs>
+Pipeline<std::decay_t<Fs>...> Pipe(Fs &&...stages) {
+  return Pipeline<std::decay_t<Fs>...>(std::forward<Fs>(stages)...);
+}
+
+}  // namespace cpppromise
@@ -0,0 +1,17 @@
+#pragma once
+
+namespace cpppromise {
+
+// The priority class of a task in an EventQueue. Each EventQueue keeps one lane
+// of tasks per priority. Its worker runs the tasks in each lane in order, and
+// favors higher lanes over lower ones, while making sure that a busy higher lane
+// does not starve the lower ones altogether (see
+// EventQueue::Options::starvation_limit).
+//
+// Control work, such as cancellations and teardowns, can use kHigh so that it
+// does not wait behind bulk work, which can use kLow.
+enum class Priority { kHigh = 0, kNormal = 1, kLow = 2 };
+
+constexpr int kNumPriorities = 3;
+
+}  // namespace cpppromise
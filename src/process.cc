@@ -4,8 +4,18 @@ namespace cpppromise {
 
 Process::Process(std::string id) : q_(id) {}
 
-Promise<Empty> Process::Enqueue(std::function<void(void)> f, std::string id) {
-  return q_.Enqueue(f, id);
+Process::Process(std::string id, EventQueue::Options options)
+    : q_(id, options) {}
+
+Promise<Empty> Process::Enqueue(std::function<void(void)> f, std::string id,
+                                Priority priority) {
+  return q_.Enqueue(f, id, priority);
+}
+
+std::vector<Promise<Empty>> Process::EnqueueBatch(
+    std::vector<std::function<void(void)>> fs, std::string id,
+    Priority priority) {
+  return q_.EnqueueBatch(std::move(fs), id, priority);
 }
 
 Schedule Process::DoPeriodically(std::function<bool()> f,
@@ -14,25 +14,47 @@ class Process {
  public:
   Process(std::string id = "");
 
+  Process(std::string id, EventQueue::Options options);
+
   virtual ~Process() = default;
 
   virtual void Join() { q_.Join(); }
 
  protected:
   template <typename T>
-  Promise<T> Enqueue(std::function<T(void)> f, std::string id = "");
+  Promise<T> Enqueue(std::function<T(void)> f, std::string id = "",
+                     Priority priority = Priority::kNormal);
+
+  Promise<Empty> Enqueue(std::function<void(void)> f, std::string id = "",
+                         Priority priority = Priority::kNormal);
+
+  template <typename T>
+  std::vector<Promise<T>> EnqueueBatch(std::vector<std::function<T(void)>> fs,
+                                       std::string id = "",
+                                       Priority priority = Priority::kNormal);
 
-  Promise<Empty> Enqueue(std::function<void(void)> f, std::string id = "");
+  std::vector<Promise<Empty>> EnqueueBatch(
+      std::vector<std::function<void(void)>> fs, std::string id = "",
+      Priority priority = Priority::kNormal);
 
   template <typename T>
   std::pair<Promise<T>, Resolver<T>> CreateResolver(std::string id = "");
 
   template <typename T>
   Promise<T> EnqueueWithResolver(std::function<void(Resolver<T>)>,
-                                 std::string id = "");
+                                 std::string id = "",
+                                 Priority priority = Priority::kNormal);
 
   void Finish() { q_.Finish(); }
 
+  Promise<Empty> WhenReadable(int fd, std::string id = "") {
+    return q_.WhenReadable(fd, id);
+  }
+
+  Promise<Empty> WhenWritable(int fd, std::string id = "") {
+    return q_.WhenWritable(fd, id);
+  }
+
   Schedule DoPeriodically(std::function<bool()> f,
                           std::chrono::nanoseconds interval,
                           std::string id = "");
@@ -5,8 +5,16 @@
 namespace cpppromise {
 
 template <typename T>
-Promise<T> Process::Enqueue(std::function<T(void)> f, std::string id) {
-  return q_.Enqueue(f, id);
+Promise<T> Process::Enqueue(std::function<T(void)> f, std::string id,
+                            Priority priority) {
+  return q_.Enqueue(f, id, priority);
+}
+
+template <typename T>
+std::vector<Promise<T>> Process::EnqueueBatch(
+    std::vector<std::function<T(void)>> fs, std::string id,
+    Priority priority) {
+  return q_.EnqueueBatch(std::move(fs), id, priority);
 }
 
 template <typename T>
@@ -16,8 +24,9 @@ std::pair<Promise<T>, Resolver<T>> Process::CreateResolver(std::string id) {
 
 template <typename T>
 Promise<T> Process::EnqueueWithResolver(
-    std::function<void(Resolver<T>)> resolve, std::string id) {
-  return q_.EnqueueWithResolver(resolve, id);
+    std::function<void(Resolver<T>)> resolve, std::string id,
+    Priority priority) {
+  return q_.EnqueueWithResolver(resolve, id, priority);
 }
 
 }  // namespace cpppromise
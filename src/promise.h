@@ -1,13 +1,146 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "cancellation_token.h"
 #include "event_queue.h"
 #include "promise_control_block.h"
 
 namespace cpppromise {
 
+template <typename T>
+class PromiseAwaiter;
+
+template <typename X>
+class Promise;
+
+// The type argument of Then when it is left to Then to work out the type of
+// the Promise it returns.
+struct DeduceThenType {};
+
+template <typename R>
+struct IsPromise : std::false_type {};
+
+template <typename Y>
+struct IsPromise<Promise<Y>> : std::true_type {};
+
+// What a Promise resolved by a continuation that returns an R holds: a
+// continuation that returns nothing resolves a Promise<Empty>, and one that
+// returns a Promise<Y> a Promise<Y>, once that one is resolved.
+template <typename R>
+struct ThenValue {
+  using type = R;
+};
+
+template <>
+struct ThenValue<void> {
+  using type = Empty;
+};
+
+template <typename Y>
+struct ThenValue<Promise<Y>> {
+  using type = Y;
+};
+
+// The type that a continuation f returns, whether it takes the result of a
+// Promise<X> or nothing.
+template <typename F, typename X>
+using ContinuationResult = typename std::conditional_t<
+    std::is_invocable_v<std::decay_t<F> &, X>,
+    std::invoke_result<std::decay_t<F> &, X>,
+    std::invoke_result<std::decay_t<F> &>>::type;
+
+// The type of the Promise that Then returns, which holds a Y, unless Y is left
+// to be deduced from what f returns.
+template <typename Y, typename F, typename X>
+using ThenType =
+    std::conditional_t<std::is_same_v<Y, DeduceThenType>,
+                       typename ThenValue<ContinuationResult<F, X>>::type, Y>;
+
+// Return a Promise of the results of all of promises, in the same order, once
+// they are all resolved.
+template <typename T>
+Promise<std::vector<T>> WhenAll(std::vector<Promise<T>> promises,
+                                std::string id = "");
+
+// Return a Promise of the index and the result of whichever of promises is
+// resolved first. promises must not be empty.
+template <typename T>
+Promise<std::pair<size_t, T>> WhenAny(std::vector<Promise<T>> promises,
+                                      std::string id = "");
+
+// Return a Promise of the indices and the results of the first n of promises
+// to be resolved, in the order they were resolved.
+template <typename T>
+Promise<std::vector<std::pair<size_t, T>>> WhenN(
+    size_t n, std::vector<Promise<T>> promises, std::string id = "");
+
+// Return a Promise that is resolved with the result of promise, or with
+// fallback if promise is not resolved within timeout. If promise is cancelled,
+// so is the returned Promise. As with Promise::WithTimeout, continuations of
+// the returned Promise must not run in an EventQueue that blocks its
+// producers.
+template <typename T>
+Promise<T> WithTimeout(Promise<T> promise, std::chrono::nanoseconds timeout,
+                       T fallback, std::string id = "");
+
+// Counts of what Hedge did, for tuning its delay: hedged / calls is the
+// fraction of calls that went to the backup as well, and backup_wins / hedged
+// the fraction of those that it answered first.
+struct HedgeStats {
+  std::atomic<long> calls{0};
+  std::atomic<long> hedged{0};
+  std::atomic<long> backup_wins{0};
+};
+
+// Return a Promise of the result of primary, unless that takes longer than
+// delay, in which case backup is started as well, and the Promise is resolved
+// with whichever result comes first. backup is also started right away if
+// primary is cancelled. The loser's token is cancelled, so it is skipped if it
+// has not started yet, and ignored otherwise. The Promise is only cancelled if
+// both are. If stats is set, Hedge counts what it does there.
+template <typename T>
+Promise<T> Hedge(std::function<Promise<T>(CancellationToken)> primary,
+                 std::function<Promise<T>(CancellationToken)> backup,
+                 std::chrono::nanoseconds delay, HedgeStats *stats = nullptr,
+                 std::string id = "");
+
+// Hedge f between two EventQueues, such as those of two replicas: run it in
+// primary, and if it has not returned within delay, in backup as well. backup
+// must not block its producers, as in OverflowPolicy::kBlock, since it is
+// handed f by the Timer's thread.
+template <typename T>
+Promise<T> Hedge(EventQueue *primary, EventQueue *backup, std::function<T()> f,
+                 std::chrono::nanoseconds delay, HedgeStats *stats = nullptr,
+                 std::string id = "");
+
+// How the functions in this library that are not members of Promise, such as
+// WhenAll and AsyncCache, attach to the Promises they are given. Not for use
+// outside the library.
+struct PromiseInternal {
+  // Call f with a pointer to the result of promise, which f may move from, in
+  // whichever thread resolves it, or right away if it is resolved already. If
+  // promise is cancelled, f gets nullptr. See PromiseControlBlock::OnResult.
+  template <typename X, typename F>
+  static void OnResult(const Promise<X> &promise, F &&f);
+
+  // Like Promise::WithTimeout, but on timeout resolve the returned Promise
+  // with fallback rather than cancel it. Backs the free function WithTimeout.
+  template <typename X>
+  static Promise<X> WithTimeout(const Promise<X> &promise,
+                                std::chrono::nanoseconds timeout, X fallback,
+                                std::string id);
+};
+
 // Class Promise is the fundamental unit of coordination between different
 // threads of execution. A Promise is a simple value type -- it is intended to
 // be passed freely by copy.
@@ -16,24 +149,72 @@ class Promise {
  public:
   explicit Promise(std::shared_ptr<PromiseControlBlock<X>> pcb);
 
-  template <typename Y>
-  Promise<Y> Then(EventQueue *q, std::function<Y(X)> f, std::string id = "");
+  // Each of these runs f in an EventQueue once this Promise is resolved, with
+  // the given priority: in q, or in the EventQueue that calls Then. f can be
+  // any callable that takes the result, or nothing. The returned Promise is
+  // resolved with what f returns. If f returns nothing, that is a
+  // Promise<Empty>, and if f returns a Promise<Y>, it is a Promise<Y> that is
+  // resolved along with the one f returns. Then<Y> gives the type explicitly.
+  template <typename Y = DeduceThenType, typename F>
+  Promise<ThenType<Y, F, X>> Then(EventQueue *q, F &&f, std::string id = "",
+                                  Priority priority = Priority::kNormal);
 
-  template <typename Y>
-  Promise<Y> Then(std::function<Y(X)> f, std::string id = "");
+  template <typename Y = DeduceThenType, typename F>
+  Promise<ThenType<Y, F, X>> Then(F &&f, std::string id = "",
+                                  Priority priority = Priority::kNormal);
 
-  template <typename Y>
-  Promise<Y> Then(std::function<Y()> f, std::string id = "");
+  // Like Then, but f runs in no EventQueue: it is called by whichever thread
+  // resolves this Promise, as it does so, or by the calling thread right away
+  // if this is resolved already. That saves a task and a hop to another
+  // thread, for continuations that are cheap, never block, take no locks that
+  // the resolving thread may hold, and are safe to run in any thread, such as
+  // picking a field out of the result. EventQueue::Get tells f nothing about
+  // where it runs, so f should not call Then without an EventQueue.
+  template <typename Y = DeduceThenType, typename F>
+  Promise<ThenType<Y, F, X>> ThenInline(F &&f, std::string id = "");
 
-  Promise<Empty> Then(std::function<void(X)> f, std::string id = "");
+  // Return a Promise of a pointer to the result of this one. However many
+  // continuations are added to the returned Promise, they all share the one
+  // result, instead of each getting a copy of it.
+  Promise<std::shared_ptr<const X>> Share(std::string id = "");
 
-  Promise<Empty> Then(std::function<void(void)> f, std::string id = "");
+  // Return a Promise that is resolved along with this one, unless token is
+  // cancelled first, in which case it is cancelled. Either way, continuations
+  // added to the returned Promise, and theirs in turn, are skipped from then
+  // on, as are the tasks they have queued but not yet started, and each of
+  // their Promises is cancelled.
+  Promise WithCancellation(CancellationToken token, std::string id = "");
 
-  // Wait for all promises to be resolved
+  // Return a Promise that is resolved along with this one, unless that takes
+  // longer than timeout, in which case it is cancelled. Its continuations are
+  // skipped, and Settled tells the timeout apart from a result. The timer is
+  // cancelled as soon as the result comes in. See also the free function
+  // WithTimeout, which resolves it with a fallback instead.
+  //
+  // On timeout, the returned Promise is settled by the Timer's thread, which
+  // hands its continuations to their EventQueues. So those must not block
+  // their producers, as in OverflowPolicy::kBlock with a capacity, since that
+  // would hold up every other timer too.
+  Promise WithTimeout(std::chrono::nanoseconds timeout, std::string id = "");
+
+  // Return a Promise that is resolved with the result of this one, or with
+  // std::nullopt if this one is cancelled.
+  Promise<std::optional<X>> Settled(std::string id = "");
+
+  // Wait for all promises to be resolved. See also WhenAll, which takes any
+  // number of Promises of the same type, and keeps their results.
   template <typename... Ys>
   static Promise<Empty> ResolveAll(std::string id, Promise<Ys>... promises);
 
  private:
+  template <typename T>
+  friend class PromiseAwaiter;
+  template <typename Y>
+  friend class Promise;
+  template <typename T>
+  friend class PromiseControlBlock;
+  friend struct PromiseInternal;
+
   std::shared_ptr<PromiseControlBlock<X>> pcb_;
 };
 
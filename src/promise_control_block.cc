@@ -0,0 +1,38 @@
+#include "promise_control_block.h"
+
+#include <utility>
+#include <vector>
+
+namespace cpppromise {
+
+namespace {
+
+// How deep the current thread is in inline continuations, and those it has
+// deferred until the outermost one is done.
+thread_local int inline_depth = 0;
+thread_local std::vector<TaskFunction> deferred_continuations;
+
+}  // namespace
+
+bool InlineContinuations::TooDeep() { return inline_depth >= kMaxDepth; }
+
+void InlineContinuations::Defer(TaskFunction f) {
+  deferred_continuations.push_back(std::move(f));
+}
+
+InlineContinuations::Scope::Scope() { inline_depth++; }
+
+InlineContinuations::Scope::~Scope() {
+  if (inline_depth == 1) {
+    // Those run here may defer more, which land at the end of the vector and
+    // are run by this same loop.
+    for (size_t i = 0; i < deferred_continuations.size(); i++) {
+      TaskFunction f = std::move(deferred_continuations[i]);
+      f();
+    }
+    deferred_continuations.clear();
+  }
+  inline_depth--;
+}
+
+}  // namespace cpppromise
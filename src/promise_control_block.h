@@ -1,34 +1,248 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <memory>
-#include <mutex>
 #include <optional>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
+#include "cancellation_token.h"
 #include "event_queue.h"
 #include "promise_listener.h"
+#include "task_function.h"
 
 namespace cpppromise {
 
+// Keeps track of the continuations added by ThenInline that a thread is
+// running, nested in one another, so that resolving a long chain of them does
+// not take a stack frame per link. Once a thread is kMaxDepth deep, further
+// ones are deferred, and run in turn by the outermost one when it is done.
+class InlineContinuations {
+ public:
+  static constexpr int kMaxDepth = 32;
+
+  // Whether the calling thread is nested too deep to start another one.
+  static bool TooDeep();
+
+  // Run f once the outermost inline continuation of this thread is done.
+  static void Defer(TaskFunction f);
+
+  // Marks an inline continuation running for as long as it exists.
+  class Scope {
+   public:
+    Scope();
+    ~Scope();
+  };
+};
+
 template <typename T>
-class PromiseControlBlock {
+class PromiseControlBlock
+    : public std::enable_shared_from_this<PromiseControlBlock<T>> {
  public:
-  PromiseControlBlock(std::string id);
+  PromiseControlBlock(std::string id, std::optional<CancellationToken> token);
+  explicit PromiseControlBlock(std::string id);
+
+  // Create a PromiseControlBlock, together with its reference counts, in a
+  // single block of memory taken from a FreeListPool. Once token is cancelled,
+  // the continuations added to it with Then are skipped, and so are theirs.
+  static std::shared_ptr<PromiseControlBlock> Create(
+      std::string id, std::optional<CancellationToken> token);
+  // The same, without a token. An overload rather than a default argument, so
+  // that callers do not make, move from and destroy an empty token of their
+  // own, which GCC takes for an uninitialized read.
+  static std::shared_ptr<PromiseControlBlock> Create(std::string id);
+
+  // Release the leases held by dependents that will never run, because this
+  // was never settled, so that their EventQueues can finish.
+  ~PromiseControlBlock();
 
   void Resolve(T result);
 
-  template <typename Y>
-  std::shared_ptr<PromiseControlBlock<Y>> Then(EventQueue *q,
-                                               std::function<Y(T)> f,
-                                               std::string id);
+  // Settle this without a result. Its dependents are told so instead of being
+  // given one, and continuations added by Then cancel theirs in turn, rather
+  // than run.
+  void Cancel();
+
+  // Cancel this, which must not be settled yet, if its token was cancelled.
+  // Return whether it was. Called by tasks before they do the work that would
+  // resolve this.
+  bool CancelIfRequested();
+
+  // Return a PromiseControlBlock that is resolved with what f returns when it
+  // is run in q with the result of this one. See Promise::Then.
+  template <typename Y, typename F>
+  std::shared_ptr<PromiseControlBlock<Y>> Then(EventQueue *q, F &&f,
+                                               std::string id,
+                                               Priority priority);
+
+  // Like Then, but f is called by whichever thread settles this. See
+  // Promise::ThenInline.
+  template <typename Y, typename F>
+  std::shared_ptr<PromiseControlBlock<Y>> ThenInline(F &&f, std::string id);
+
+  // Return a PromiseControlBlock that is resolved with a pointer to the result
+  // of this one, once it is resolved. The result is stored only once, however
+  // many dependents the returned one has.
+  std::shared_ptr<PromiseControlBlock<std::shared_ptr<const T>>> Share(
+      std::string id);
+
+  // Return a PromiseControlBlock that is resolved along with this one, unless
+  // token is cancelled first, in which case it is cancelled. See
+  // Promise::WithCancellation.
+  std::shared_ptr<PromiseControlBlock> WithCancellation(CancellationToken token,
+                                                        std::string id);
+
+  // Return a PromiseControlBlock that is resolved along with this one, unless
+  // that takes longer than timeout, in which case it is resolved with fallback,
+  // or cancelled if there is none. See Promise::WithTimeout.
+  std::shared_ptr<PromiseControlBlock> WithTimeout(
+      std::chrono::nanoseconds timeout, std::optional<T> fallback,
+      std::string id);
+
+  // Run f in q once this is resolved or cancelled. Unlike Then, f gets no
+  // value and no new PromiseControlBlock is created for its result; f reads
+  // the result with Value itself. Used to resume coroutines.
+  void OnResolved(EventQueue *q, TaskFunction f);
+
+  // Call f with a pointer to the result, which f may move from, as soon as
+  // this is resolved, in whichever thread resolves it, or right away if it
+  // already is. If this is cancelled instead, f gets nullptr. Unlike Then, f
+  // runs in no EventQueue and makes no PromiseControlBlock, so it must be
+  // quick and must not block. Used by combinators such as WhenAll.
+  void OnResult(InlineFunction<void(T *)> f);
+
+  bool Resolved();
+
+  bool Cancelled();
+
+  // Return the result. Must only be called once this is resolved. A move-only
+  // result can only be taken once.
+  T Value();
 
  private:
-  void NotifyDependents();
+  template <typename U>
+  friend class PromiseControlBlock;
+
+  // What a dependent added by Then calls with the result, to get the task to
+  // enqueue, or with nullptr, to cancel the continuation.
+  using ThenFunction = InlineFunction<TaskFunction(T *)>;
+  // What a dependent added by OnResult calls with the result, or nullptr.
+  using ConsumeFunction = InlineFunction<void(T *)>;
+
+  // A continuation added by Then or OnResolved, which holds a lease on the
+  // EventQueue it runs in until it is enqueued there, or this is cancelled.
+  // Continuations added by Then have a ThenFunction; those added by
+  // OnResolved have the task itself. A dependent without an EventQueue has a
+  // task, or a ConsumeFunction added by OnResult, that is run as soon as this
+  // is settled, by whoever settles it. Only one of them is ever set, so they
+  // share the space.
+  struct Dependent {
+    EventQueue *q;
+    std::variant<ThenFunction, TaskFunction, ConsumeFunction> f;
+    std::string id;
+    Priority priority = Priority::kNormal;
+  };
+
+  // What WithTimeout's timer and the dependent that it adds share. Whichever of
+  // them sets done first settles pcb.
+  struct Timeout {
+    std::atomic<bool> done{false};
+    uint64_t timer = 0;
+    std::optional<T> fallback;
+    std::shared_ptr<PromiseControlBlock> pcb;
+  };
+
+  // A Dependent waiting for this to be settled, in the list held by state_.
+  struct DependentNode {
+    Dependent d;
+    DependentNode *next;
+
+    // Nodes are recycled through a FreeListPool, so that adding a dependent
+    // does not allocate in the steady state.
+    static void *operator new(std::size_t size);
+    static void operator delete(void *p);
+  };
+
+  // The flags in the low bits of state_. kSettled is set once this is either
+  // resolved or cancelled.
+  static constexpr uintptr_t kSettled = 1;
+  static constexpr uintptr_t kNotifying = 2;
+  static constexpr uintptr_t kFlags = kSettled | kNotifying;
+
+  // Call f, with value unless it takes nothing, and resolve resolver with what
+  // it returns.
+  template <typename Y, typename F>
+  static void Continue(F &f, T value, Resolver<Y> &resolver);
+
+  // Publish the result, or the lack of one, and notify the dependents.
+  void Settle();
+  void AddDependent(Dependent d);
+  // Put d in first_node_, unless that is taken, or else in a node from the
+  // pool.
+  DependentNode *NewNode(Dependent d);
+  // Destroy a node made by NewNode.
+  void FreeNode(DependentNode *node);
+  // Hand d its result, or enqueue its task.
+  void Notify(Dependent &d, bool last_use);
+  // Notify the dependents in list, which is newest first, and then any that
+  // are added in the meantime, until there are none left. Must only be called
+  // by the thread that set kNotifying. The settling thread may hand the last
+  // dependent the result itself.
+  void NotifyDependents(DependentNode *list, bool settling);
+  // Return the result for a dependent, moving it out if this is its last use.
+  T TakeResult(bool last_use);
 
   std::optional<T> result_;
-  std::mutex mu_;
-  std::vector<std::function<void(T)>> dependents_;
+  // Whether result_ was moved out, after which nothing may read it.
+  bool taken_ = false;
+  // Whether result_ was shared by Share, after which it must not be moved out.
+  bool shared_ = false;
+  // Whether this was cancelled, rather than resolved.
+  bool cancelled_ = false;
+  // If set, the token that cancels continuations of this, which they inherit.
+  const std::optional<CancellationToken> token_;
+  // Until this is settled, the dependents added so far, newest first, or null.
+  // Resolve and Cancel publish result_ and cancelled_ by setting kSettled, and
+  // take the list. While some thread is notifying dependents, kNotifying is
+  // set, and the list holds those that it has yet to get to.
+  std::atomic<uintptr_t> state_;
+  // Most PromiseControlBlocks get no more than one dependent, so the first one
+  // is stored here rather than in a node of its own. Whoever sets
+  // first_node_taken_ gets to use it, once.
+  std::atomic<bool> first_node_taken_{false};
+  alignas(DependentNode) unsigned char first_node_[sizeof(DependentNode)];
   std::shared_ptr<PromiseListener> p_listener;
 };
 
+// Holds the PromiseControlBlock that a task is to settle, and cancels it if the
+// task is destroyed without having taken it, as when an EventQueue at capacity
+// refuses or drops the task. Otherwise, its Promise would never be settled.
+template <typename T>
+class PendingResult {
+ public:
+  explicit PendingResult(std::shared_ptr<PromiseControlBlock<T>> pcb)
+      : pcb_(std::move(pcb)) {}
+
+  PendingResult(PendingResult &&) noexcept = default;
+  PendingResult &operator=(PendingResult &&) = delete;
+
+  ~PendingResult() {
+    if (pcb_) {
+      pcb_->Cancel();
+    }
+  }
+
+  // Take the PromiseControlBlock, to settle it. Only the task's first run may
+  // call this.
+  std::shared_ptr<PromiseControlBlock<T>> Take() { return std::move(pcb_); }
+
+ private:
+  std::shared_ptr<PromiseControlBlock<T>> pcb_;
+};
+
 }  // namespace cpppromise
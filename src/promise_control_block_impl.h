@@ -1,56 +1,463 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
 #include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <variant>
 
+#include "empty.h"
+#include "free_list_pool.h"
 #include "lifecycle_listener_manager.h"
+#include "promise.h"
 #include "promise_control_block.h"
+#include "resolver.h"
+#include "timer.h"
 
 namespace cpppromise {
 
 template <typename T>
-PromiseControlBlock<T>::PromiseControlBlock(std::string id) {
+PromiseControlBlock<T>::PromiseControlBlock(
+    std::string id, std::optional<CancellationToken> token)
+    : token_(std::move(token)), state_(0) {
   if (LifecycleListenerManager::Get()) {
     p_listener = LifecycleListenerManager::Get()->OnPromiseCreated(id);
   }
 }
 
+template <typename T>
+PromiseControlBlock<T>::PromiseControlBlock(std::string id)
+    : PromiseControlBlock(std::move(id), std::nullopt) {}
+
+template <typename T>
+std::shared_ptr<PromiseControlBlock<T>> PromiseControlBlock<T>::Create(
+    std::string id, std::optional<CancellationToken> token) {
+  return std::allocate_shared<PromiseControlBlock<T>>(
+      PoolAllocator<PromiseControlBlock<T>>(), std::move(id),
+      std::move(token));
+}
+
+template <typename T>
+std::shared_ptr<PromiseControlBlock<T>> PromiseControlBlock<T>::Create(
+    std::string id) {
+  return std::allocate_shared<PromiseControlBlock<T>>(
+      PoolAllocator<PromiseControlBlock<T>>(), std::move(id));
+}
+
+template <typename T>
+PromiseControlBlock<T>::~PromiseControlBlock() {
+  DependentNode *node = reinterpret_cast<DependentNode *>(
+      state_.load(std::memory_order_acquire) & ~kFlags);
+  while (node != nullptr) {
+    DependentNode *next = node->next;
+    if (node->d.q) {
+      node->d.q->Release();
+    }
+    FreeNode(node);
+    node = next;
+  }
+}
+
+template <typename T>
+void *PromiseControlBlock<T>::DependentNode::operator new(std::size_t size) {
+  assert(size == sizeof(DependentNode));
+  return FreeListPool<sizeof(DependentNode)>::Allocate();
+}
+
+template <typename T>
+void PromiseControlBlock<T>::DependentNode::operator delete(void *p) {
+  FreeListPool<sizeof(DependentNode)>::Free(p);
+}
+
 template <typename T>
 void PromiseControlBlock<T>::Resolve(T result) {
-  std::unique_lock<std::mutex> lock(mu_);
-  assert(!result_.has_value());
-  result_ = result;
-  NotifyDependents();
+  assert(!Resolved() && !Cancelled());
+  result_ = std::move(result);
+  Settle();
+}
+
+template <typename T>
+void PromiseControlBlock<T>::Cancel() {
+  assert(!Resolved() && !Cancelled());
+  cancelled_ = true;
+  Settle();
+}
+
+template <typename T>
+void PromiseControlBlock<T>::Settle() {
+  // Publish the result, and take the dependents added so far. Any added from
+  // now on either find kNotifying set and are left to us, or find the result.
+  uintptr_t state =
+      state_.exchange(kSettled | kNotifying, std::memory_order_acq_rel);
+  assert(!(state & kSettled));
+  NotifyDependents(reinterpret_cast<DependentNode *>(state), true);
   if (p_listener) {
-    p_listener->OnResolved();
+    if (cancelled_) {
+      p_listener->OnCancelled();
+    } else {
+      p_listener->OnResolved();
+    }
+  }
+}
+
+template <typename T>
+bool PromiseControlBlock<T>::CancelIfRequested() {
+  if (!token_ || !token_->IsCancelled()) {
+    return false;
   }
+  Cancel();
+  return true;
 }
 
 template <typename X>
-template <typename Y>
+template <typename Y, typename F>
 std::shared_ptr<PromiseControlBlock<Y>> PromiseControlBlock<X>::Then(
-    EventQueue *q, std::function<Y(X)> f, std::string id) {
-  std::unique_lock<std::mutex> lock(mu_);
-  auto pcb = std::make_shared<PromiseControlBlock<Y>>(id);
+    EventQueue *q, F &&f, std::string id, Priority priority) {
+  auto pcb = PromiseControlBlock<Y>::Create(id, token_);
+  Resolver<Y> resolver(pcb);
+  // Each dependent is called only once, so it can give away what it holds.
+  // f is kept as it is, so a small one fits inline with the rest. Once this
+  // or the token is cancelled, f is skipped, and ours is cancelled too, before
+  // or after the task is queued.
+  auto then = [f = std::forward<F>(f),
+               resolver = std::move(resolver)](X *value) mutable {
+    if (value == nullptr) {
+      resolver.Cancel();
+      return TaskFunction(nullptr);
+    }
+    if (resolver.pcb_->CancelIfRequested()) {
+      return TaskFunction(nullptr);
+    }
+    // If q refuses or drops the task, ours is cancelled.
+    return TaskFunction(
+        [f = std::move(f), result = PendingResult<Y>(std::move(resolver.pcb_)),
+         value = std::move(*value)]() mutable {
+          Resolver<Y> resolver(result.Take());
+          if (!resolver.pcb_->CancelIfRequested()) {
+            Continue(f, std::move(value), resolver);
+          }
+        });
+  };
+  AddDependent({q, ThenFunction(std::move(then)), std::move(id), priority});
+  return pcb;
+}
+
+template <typename X>
+template <typename Y, typename F>
+std::shared_ptr<PromiseControlBlock<Y>> PromiseControlBlock<X>::ThenInline(
+    F &&f, std::string id) {
+  auto pcb = PromiseControlBlock<Y>::Create(std::move(id), token_);
   Resolver<Y> resolver(pcb);
-  dependents_.push_back([q, f, resolver, id](X value) mutable {
-    q->AddTask([f, resolver, value]() mutable { resolver.Resolve(f(value)); },
-               id);
-    q->Release();
+  // Runs in the thread that settles this, which may be deep in other inline
+  // continuations already, in which case f waits for them to unwind.
+  OnResult([f = std::forward<F>(f),
+            resolver = std::move(resolver)](X *value) mutable {
+    if (value == nullptr) {
+      resolver.Cancel();
+      return;
+    }
+    if (resolver.pcb_->CancelIfRequested()) {
+      return;
+    }
+    if (InlineContinuations::TooDeep()) {
+      InlineContinuations::Defer([f = std::move(f),
+                                  resolver = std::move(resolver),
+                                  value = std::move(*value)]() mutable {
+        InlineContinuations::Scope scope;
+        Continue(f, std::move(value), resolver);
+      });
+      return;
+    }
+    InlineContinuations::Scope scope;
+    Continue(f, std::move(*value), resolver);
   });
-  q->Take();
-  if (result_.has_value()) {
-    NotifyDependents();
+  return pcb;
+}
+
+template <typename T>
+template <typename Y, typename F>
+void PromiseControlBlock<T>::Continue(F &f, T value, Resolver<Y> &resolver) {
+  auto call = [&]() -> decltype(auto) {
+    if constexpr (std::is_invocable_v<F &, T>) {
+      return f(std::move(value));
+    } else {
+      return f();
+    }
+  };
+  using R = decltype(call());
+  if constexpr (std::is_void_v<R>) {
+    call();
+    resolver.Resolve(Empty{});
+  } else if constexpr (IsPromise<std::decay_t<R>>::value &&
+                       std::is_same_v<typename ThenValue<std::decay_t<R>>::type,
+                                      Y>) {
+    // Resolve ours along with the Promise that f returned, in whichever
+    // thread resolves that one.
+    std::decay_t<R> inner = call();
+    inner.pcb_->OnResult([resolver](Y *y) mutable {
+      if (y != nullptr) {
+        resolver.Resolve(std::move(*y));
+      } else {
+        resolver.Cancel();
+      }
+    });
+  } else {
+    resolver.Resolve(call());
   }
+}
+
+template <typename T>
+std::shared_ptr<PromiseControlBlock<std::shared_ptr<const T>>>
+PromiseControlBlock<T>::Share(std::string id) {
+  auto shared = PromiseControlBlock<std::shared_ptr<const T>>::Create(id);
+  // Only a weak pointer to this, or the two would keep each other alive if
+  // this is never settled. Whoever settles this holds on to it.
+  TaskFunction resolve = [weak = this->weak_from_this(), shared]() {
+    std::shared_ptr<PromiseControlBlock<T>> self = weak.lock();
+    if (self->cancelled_) {
+      shared->Cancel();
+      return;
+    }
+    assert(!self->taken_);
+    self->shared_ = true;
+    // The pointer keeps this, and so the result, alive.
+    shared->Resolve(std::shared_ptr<const T>(self, &self->result_.value()));
+  };
+  AddDependent({nullptr, std::move(resolve), ""});
+  return shared;
+}
+
+template <typename T>
+std::shared_ptr<PromiseControlBlock<T>>
+PromiseControlBlock<T>::WithCancellation(CancellationToken token,
+                                         std::string id) {
+  auto pcb = Create(std::move(id), token);
+  // Whichever comes first, this being settled or token being cancelled,
+  // settles pcb. token may outlive pcb, so it only gets a weak pointer.
+  auto callback = token.OnCancel(
+      [weak = std::weak_ptr<PromiseControlBlock<T>>(pcb)]() {
+        if (std::shared_ptr<PromiseControlBlock<T>> pcb = weak.lock()) {
+          pcb->Cancel();
+        }
+      });
+  OnResult([pcb, callback](T *value) {
+    if (callback->done.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    if (value != nullptr) {
+      pcb->Resolve(std::move(*value));
+    } else {
+      pcb->Cancel();
+    }
+  });
+  return pcb;
+}
+
+template <typename T>
+std::shared_ptr<PromiseControlBlock<T>> PromiseControlBlock<T>::WithTimeout(
+    std::chrono::nanoseconds timeout, std::optional<T> fallback,
+    std::string id) {
+  auto timeout_state = std::allocate_shared<Timeout>(PoolAllocator<Timeout>());
+  timeout_state->fallback = std::move(fallback);
+  timeout_state->pcb = Create(std::move(id), token_);
+  std::shared_ptr<PromiseControlBlock<T>> pcb = timeout_state->pcb;
+  // The timer is set before the dependent is added, so the dependent always
+  // finds its ID, and cancels it if the result comes first.
+  timeout_state->timer = Timer::Get()->Schedule(
+      Timer::Get()->Now() + timeout, [timeout_state]() {
+        if (timeout_state->done.exchange(true, std::memory_order_acq_rel)) {
+          return;
+        }
+        if (timeout_state->fallback) {
+          timeout_state->pcb->Resolve(std::move(*timeout_state->fallback));
+        } else {
+          timeout_state->pcb->Cancel();
+        }
+      });
+  OnResult([timeout_state](T *value) {
+    if (timeout_state->done.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    Timer::Get()->Cancel(timeout_state->timer);
+    if (value != nullptr) {
+      timeout_state->pcb->Resolve(std::move(*value));
+    } else {
+      timeout_state->pcb->Cancel();
+    }
+  });
   return pcb;
 }
 
 template <typename T>
-void PromiseControlBlock<T>::NotifyDependents() {
-  for (auto d : dependents_) {
-    d(result_.value());
+void PromiseControlBlock<T>::OnResolved(EventQueue *q, TaskFunction f) {
+  AddDependent({q, std::move(f), ""});
+}
+
+template <typename T>
+void PromiseControlBlock<T>::OnResult(InlineFunction<void(T *)> f) {
+  AddDependent({nullptr, std::move(f), ""});
+}
+
+template <typename T>
+void PromiseControlBlock<T>::AddDependent(Dependent d) {
+  if (d.q) {
+    d.q->Take();
+  }
+  uintptr_t state = state_.load(std::memory_order_acquire);
+  DependentNode *node = nullptr;
+  while (true) {
+    if (state == kSettled) {
+      // Settled, and nobody is notifying dependents any more, so d goes
+      // straight through, without being linked in.
+      if (state_.compare_exchange_weak(state, kSettled | kNotifying,
+                                       std::memory_order_acquire)) {
+        if (node != nullptr) {
+          Notify(node->d, false);
+          FreeNode(node);
+        } else {
+          Notify(d, false);
+        }
+        NotifyDependents(nullptr, false);
+        return;
+      }
+      continue;
+    }
+    if (node == nullptr) {
+      node = NewNode(std::move(d));
+    }
+    node->next = reinterpret_cast<DependentNode *>(state & ~kFlags);
+    if (state_.compare_exchange_weak(
+            state, reinterpret_cast<uintptr_t>(node) | (state & kFlags),
+            std::memory_order_release, std::memory_order_acquire)) {
+      return;
+    }
+  }
+}
+
+template <typename T>
+typename PromiseControlBlock<T>::DependentNode *
+PromiseControlBlock<T>::NewNode(Dependent d) {
+  // The node is published along with the list it is pushed onto, so the flag
+  // only needs to tell who gets it.
+  if (!first_node_taken_.load(std::memory_order_relaxed) &&
+      !first_node_taken_.exchange(true, std::memory_order_relaxed)) {
+    return ::new (static_cast<void *>(first_node_))
+        DependentNode{std::move(d), nullptr};
+  }
+  return new DependentNode{std::move(d), nullptr};
+}
+
+template <typename T>
+void PromiseControlBlock<T>::FreeNode(DependentNode *node) {
+  if (static_cast<void *>(node) == first_node_) {
+    node->~DependentNode();
+  } else {
+    delete node;
+  }
+}
+
+template <typename T>
+bool PromiseControlBlock<T>::Resolved() {
+  return (state_.load(std::memory_order_acquire) & kSettled) && !cancelled_;
+}
+
+template <typename T>
+bool PromiseControlBlock<T>::Cancelled() {
+  return (state_.load(std::memory_order_acquire) & kSettled) && cancelled_;
+}
+
+template <typename T>
+T PromiseControlBlock<T>::Value() {
+  assert(Resolved());
+  return TakeResult(false);
+}
+
+template <typename T>
+T PromiseControlBlock<T>::TakeResult(bool last_use) {
+  assert(!taken_);
+  if constexpr (std::is_copy_constructible_v<T>) {
+    if (!last_use || shared_) {
+      return result_.value();
+    }
+  } else {
+    assert(!shared_);
+  }
+  taken_ = true;
+  return std::move(result_.value());
+}
+
+template <typename T>
+void PromiseControlBlock<T>::Notify(Dependent &d, bool last_use) {
+  if (ThenFunction *then = std::get_if<ThenFunction>(&d.f)) {
+    if (cancelled_) {
+      (*then)(nullptr);
+    } else {
+      T value = TakeResult(last_use);
+      if (TaskFunction task = (*then)(&value)) {
+        d.q->AddTask(std::move(task), std::move(d.id), d.priority);
+      }
+    }
+  } else if (ConsumeFunction *consume = std::get_if<ConsumeFunction>(&d.f)) {
+    if (cancelled_) {
+      (*consume)(nullptr);
+    } else {
+      T value = TakeResult(last_use);
+      (*consume)(&value);
+    }
+  } else if (d.q) {
+    d.q->AddTask(std::get<TaskFunction>(std::move(d.f)), std::move(d.id),
+                 d.priority);
+  } else {
+    std::get<TaskFunction>(d.f)();
+  }
+  if (d.q) {
+    d.q->Release();
+  }
+}
+
+template <typename T>
+void PromiseControlBlock<T>::NotifyDependents(DependentNode *list,
+                                              bool settling) {
+  while (true) {
+    // Reverse the list, to notify dependents in the order they were added.
+    DependentNode *ordered = nullptr;
+    while (list != nullptr) {
+      DependentNode *next = list->next;
+      list->next = ordered;
+      ordered = list;
+      list = next;
+    }
+    while (ordered != nullptr) {
+      DependentNode *node = ordered;
+      ordered = node->next;
+      // Once nothing but the caller, who is settling this, holds on to it,
+      // no more dependents can be added and nothing can read the result, so
+      // the last dependent can have the result itself rather than a copy.
+      // The fence makes sure that we see the dependents added by whoever
+      // dropped the other references.
+      bool last_use = settling && ordered == nullptr &&
+                      this->weak_from_this().use_count() == 1;
+      if (last_use) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        last_use = state_.load(std::memory_order_relaxed) ==
+                   (kSettled | kNotifying);
+      }
+      Notify(node->d, last_use);
+      FreeNode(node);
+    }
+    uintptr_t state = kSettled | kNotifying;
+    if (state_.compare_exchange_strong(state, kSettled,
+                                       std::memory_order_release,
+                                       std::memory_order_acquire)) {
+      return;
+    }
+    // More dependents were added in the meantime.
+    list = reinterpret_cast<DependentNode *>(
+        state_.exchange(kSettled | kNotifying, std::memory_order_acquire) &
+        ~kFlags);
   }
-  dependents_.clear();
 }
 
 }  // namespace cpppromise
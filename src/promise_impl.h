@@ -1,70 +1,403 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <optional>
+#include <type_traits>
+
+#include "free_list_pool.h"
 #include "promise.h"
 #include "resolver.h"
+#include "timer.h"
 
 namespace cpppromise {
 
 template <typename X>
 Promise<X>::Promise(std::shared_ptr<PromiseControlBlock<X>> pcb) : pcb_(pcb) {}
 
+template <typename X, typename F>
+void PromiseInternal::OnResult(const Promise<X> &promise, F &&f) {
+  promise.pcb_->OnResult(std::forward<F>(f));
+}
+
+template <typename X>
+Promise<X> PromiseInternal::WithTimeout(const Promise<X> &promise,
+                                        std::chrono::nanoseconds timeout,
+                                        X fallback, std::string id) {
+  return Promise<X>(
+      promise.pcb_->WithTimeout(timeout, std::move(fallback), std::move(id)));
+}
+
 template <typename X>
-template <typename Y>
-Promise<Y> Promise<X>::Then(EventQueue *q, std::function<Y(X)> f,
-                            std::string id) {
-  return Promise<Y>(pcb_->Then(q, f, id));
+template <typename Y, typename F>
+Promise<ThenType<Y, F, X>> Promise<X>::Then(EventQueue *q, F &&f,
+                                            std::string id,
+                                            Priority priority) {
+  return Promise<ThenType<Y, F, X>>(
+      pcb_->template Then<ThenType<Y, F, X>>(q, std::forward<F>(f), id,
+                                             priority));
 }
 
 template <typename X>
-template <typename Y>
-Promise<Y> Promise<X>::Then(std::function<Y(X)> f, std::string id) {
+template <typename Y, typename F>
+Promise<ThenType<Y, F, X>> Promise<X>::Then(F &&f, std::string id,
+                                            Priority priority) {
   assert(EventQueue::Get() != nullptr);
-  return Then(EventQueue::Get(), f, id);
+  return Then<Y>(EventQueue::Get(), std::forward<F>(f), id, priority);
 }
 
 template <typename X>
-template <typename Y>
-Promise<Y> Promise<X>::Then(std::function<Y()> f, std::string id) {
-  return Then<Y>([f](X) { return f(); }, id);
+template <typename Y, typename F>
+Promise<ThenType<Y, F, X>> Promise<X>::ThenInline(F &&f, std::string id) {
+  return Promise<ThenType<Y, F, X>>(
+      pcb_->template ThenInline<ThenType<Y, F, X>>(std::forward<F>(f), id));
 }
 
 template <typename X>
-Promise<Empty> Promise<X>::Then(std::function<void(X)> f, std::string id) {
-  return Then<Empty>(
-      [f](X x) {
-        f(x);
-        return Empty{};
-      },
-      id);
+Promise<std::shared_ptr<const X>> Promise<X>::Share(std::string id) {
+  return Promise<std::shared_ptr<const X>>(pcb_->Share(id));
 }
 
 template <typename X>
-Promise<Empty> Promise<X>::Then(std::function<void()> f, std::string id) {
-  return Then(
-      [f](X) {
-        f();
-        return Empty{};
-      },
-      id);
+Promise<X> Promise<X>::WithCancellation(CancellationToken token,
+                                        std::string id) {
+  return Promise<X>(pcb_->WithCancellation(std::move(token), std::move(id)));
+}
+
+template <typename X>
+Promise<X> Promise<X>::WithTimeout(std::chrono::nanoseconds timeout,
+                                   std::string id) {
+  return Promise<X>(pcb_->WithTimeout(timeout, std::nullopt, std::move(id)));
+}
+
+template <typename T>
+Promise<T> WithTimeout(Promise<T> promise, std::chrono::nanoseconds timeout,
+                       T fallback, std::string id) {
+  return PromiseInternal::WithTimeout(promise, timeout, std::move(fallback),
+                                      std::move(id));
+}
+
+template <typename X>
+Promise<std::optional<X>> Promise<X>::Settled(std::string id) {
+  auto pcb = PromiseControlBlock<std::optional<X>>::Create(std::move(id));
+  pcb_->OnResult([pcb](X *result) {
+    if (result != nullptr) {
+      pcb->Resolve(std::move(*result));
+    } else {
+      pcb->Resolve(std::nullopt);
+    }
+  });
+  return Promise<std::optional<X>>(pcb);
 }
 
+// The state that the inputs of ResolveAll share, in one block of memory.
+// Each input counts down as it is resolved, in whichever thread resolves it,
+// and the last one resolves the result. The first input to be cancelled
+// cancels the result instead, and the count never gets to zero.
+struct ResolveAllState {
+  ResolveAllState(size_t n, Resolver<Empty> resolver)
+      : remaining(n), cancelled(false), resolver(std::move(resolver)) {}
+
+  std::atomic<size_t> remaining;
+  std::atomic<bool> cancelled;
+  Resolver<Empty> resolver;
+};
+
 template <>
 template <typename... Ys>
 inline Promise<Empty> Promise<Empty>::ResolveAll(std::string id,
                                                  Promise<Ys>... promises) {
   auto pair = EventQueue::CreateResolver<Empty>(id);
-  std::shared_ptr<int> count = std::make_shared<int>(sizeof...(promises));
-
-  (promises.template Then(
-       [count, resolver = pair.second]() mutable {
-         if (--(*count) == 0) {
-           resolver.Resolve(Empty());
-         }
-       },
-       ""),
+  if (sizeof...(promises) == 0) {
+    pair.second.Resolve(Empty());
+    return pair.first;
+  }
+  auto state = std::allocate_shared<ResolveAllState>(
+      PoolAllocator<ResolveAllState>(), sizeof...(promises),
+      std::move(pair.second));
+
+  (promises.pcb_->OnResult([state](Ys *result) {
+    if (result == nullptr) {
+      if (!state->cancelled.exchange(true)) {
+        state->resolver.Cancel();
+      }
+    } else if (state->remaining.fetch_sub(1) == 1) {
+      state->resolver.Resolve(Empty());
+    }
+  }),
    ...);
 
   return pair.first;
 }
 
+template <typename T>
+struct WhenAllState {
+  // Results are stored straight into the vector that WhenAll resolves with,
+  // unless they cannot be default constructed, or std::vector<bool> would
+  // pack them into bits that cannot be written concurrently.
+  static constexpr bool kDirect =
+      std::is_default_constructible_v<T> && !std::is_same_v<T, bool>;
+  using Slot = std::conditional_t<kDirect, T, std::optional<T>>;
+
+  WhenAllState(size_t n, Resolver<std::vector<T>> resolver)
+      : remaining(n),
+        cancelled(false),
+        slots(n),
+        resolver(std::move(resolver)) {}
+
+  void Finish() {
+    if constexpr (kDirect) {
+      resolver.Resolve(std::move(slots));
+    } else {
+      std::vector<T> results;
+      results.reserve(slots.size());
+      for (auto &slot : slots) {
+        results.push_back(std::move(slot.value()));
+      }
+      resolver.Resolve(std::move(results));
+    }
+  }
+
+  std::atomic<size_t> remaining;
+  // As for ResolveAll, the first input to be cancelled cancels the result.
+  std::atomic<bool> cancelled;
+  std::vector<Slot> slots;
+  Resolver<std::vector<T>> resolver;
+};
+
+template <typename T>
+Promise<std::vector<T>> WhenAll(std::vector<Promise<T>> promises,
+                                std::string id) {
+  auto pair = EventQueue::CreateResolver<std::vector<T>>(std::move(id));
+  if (promises.empty()) {
+    pair.second.Resolve({});
+    return pair.first;
+  }
+  auto state = std::allocate_shared<WhenAllState<T>>(
+      PoolAllocator<WhenAllState<T>>(), promises.size(),
+      std::move(pair.second));
+  for (size_t i = 0; i < promises.size(); i++) {
+    PromiseInternal::OnResult(promises[i], [state, i](T *result) {
+      if (result == nullptr) {
+        if (!state->cancelled.exchange(true)) {
+          state->resolver.Cancel();
+        }
+        return;
+      }
+      state->slots[i] = std::move(*result);
+      // Whoever stores the last result sees all the others too.
+      if (state->remaining.fetch_sub(1) == 1) {
+        state->Finish();
+      }
+    });
+  }
+  return pair.first;
+}
+
+template <typename T>
+struct WhenAnyState {
+  WhenAnyState(size_t n, Resolver<std::pair<size_t, T>> resolver)
+      : done(false), cancelled(0), n(n), resolver(std::move(resolver)) {}
+
+  std::atomic<bool> done;
+  // The number of inputs cancelled. The result is only cancelled once they
+  // all are.
+  std::atomic<size_t> cancelled;
+  const size_t n;
+  Resolver<std::pair<size_t, T>> resolver;
+};
+
+template <typename T>
+Promise<std::pair<size_t, T>> WhenAny(std::vector<Promise<T>> promises,
+                                      std::string id) {
+  assert(!promises.empty());
+  auto pair = EventQueue::CreateResolver<std::pair<size_t, T>>(std::move(id));
+  auto state = std::allocate_shared<WhenAnyState<T>>(
+      PoolAllocator<WhenAnyState<T>>(), promises.size(),
+      std::move(pair.second));
+  for (size_t i = 0; i < promises.size(); i++) {
+    PromiseInternal::OnResult(promises[i], [state, i](T *result) {
+      if (result == nullptr) {
+        if (state->cancelled.fetch_add(1) + 1 == state->n &&
+            !state->done.exchange(true)) {
+          state->resolver.Cancel();
+        }
+      } else if (!state->done.exchange(true)) {
+        state->resolver.Resolve({i, std::move(*result)});
+      }
+    });
+  }
+  return pair.first;
+}
+
+template <typename T>
+struct WhenNState {
+  WhenNState(size_t n, size_t spare,
+             Resolver<std::vector<std::pair<size_t, T>>> resolver)
+      : claimed(0),
+        stored(0),
+        cancelled(0),
+        spare(spare),
+        slots(n),
+        resolver(std::move(resolver)) {}
+
+  // How many results have claimed a slot, and how many of those are stored.
+  std::atomic<size_t> claimed;
+  std::atomic<size_t> stored;
+  // How many inputs were cancelled. Once more than spare of them are, too few
+  // are left to fill the slots, and the result is cancelled.
+  std::atomic<size_t> cancelled;
+  const size_t spare;
+  std::vector<std::optional<std::pair<size_t, T>>> slots;
+  Resolver<std::vector<std::pair<size_t, T>>> resolver;
+};
+
+template <typename T>
+Promise<std::vector<std::pair<size_t, T>>> WhenN(
+    size_t n, std::vector<Promise<T>> promises, std::string id) {
+  assert(n <= promises.size());
+  auto pair = EventQueue::CreateResolver<std::vector<std::pair<size_t, T>>>(
+      std::move(id));
+  if (n == 0) {
+    pair.second.Resolve({});
+    return pair.first;
+  }
+  auto state = std::allocate_shared<WhenNState<T>>(
+      PoolAllocator<WhenNState<T>>(), n, promises.size() - n,
+      std::move(pair.second));
+  for (size_t i = 0; i < promises.size(); i++) {
+    PromiseInternal::OnResult(promises[i], [state, i](T *result) {
+      if (result == nullptr) {
+        if (state->cancelled.fetch_add(1) == state->spare) {
+          state->resolver.Cancel();
+        }
+        return;
+      }
+      size_t slot = state->claimed.fetch_add(1);
+      if (slot >= state->slots.size()) {
+        return;
+      }
+      state->slots[slot].emplace(i, std::move(*result));
+      if (state->stored.fetch_add(1) + 1 == state->slots.size()) {
+        std::vector<std::pair<size_t, T>> results;
+        results.reserve(state->slots.size());
+        for (auto &s : state->slots) {
+          results.push_back(std::move(s.value()));
+        }
+        state->resolver.Resolve(std::move(results));
+      }
+    });
+  }
+  return pair.first;
+}
+
+// The state that the two attempts of a Hedge, and its timer, share. The first
+// attempt to come back with a result sets done, and resolves the result.
+template <typename T>
+struct HedgeState {
+  HedgeState(std::function<Promise<T>(CancellationToken)> backup,
+             HedgeStats *stats, Resolver<T> resolver)
+      : done(false),
+        hedged(false),
+        failed(0),
+        timer(0),
+        backup(std::move(backup)),
+        stats(stats),
+        resolver(std::move(resolver)) {}
+
+  // Start attempt i, with f.
+  static void Start(const std::shared_ptr<HedgeState> &state, int i,
+                    const std::function<Promise<T>(CancellationToken)> &f) {
+    PromiseInternal::OnResult(f(state->tokens[i]), [state, i](T *result) {
+      Finish(state, i, result);
+    });
+  }
+
+  // Start the backup, unless it is started already, or a result is in.
+  static void StartBackup(const std::shared_ptr<HedgeState> &state) {
+    if (state->done.load() || state->hedged.exchange(true)) {
+      return;
+    }
+    if (state->stats) {
+      state->stats->hedged++;
+    }
+    Start(state, 1, state->backup);
+  }
+
+  static void Finish(const std::shared_ptr<HedgeState> &state, int i,
+                     T *result) {
+    if (result == nullptr) {
+      // Either this lost, and was cancelled by the winner, or it failed, and
+      // the other attempt is the only hope left.
+      if (state->done.load()) {
+        return;
+      }
+      if (i == 0) {
+        Timer::Get()->Cancel(state->timer);
+        StartBackup(state);
+      }
+      if (state->failed.fetch_add(1) + 1 == 2 && !state->done.exchange(true)) {
+        state->resolver.Cancel();
+      }
+      return;
+    }
+    if (state->done.exchange(true)) {
+      return;
+    }
+    if (i == 0) {
+      Timer::Get()->Cancel(state->timer);
+    } else if (state->stats) {
+      state->stats->backup_wins++;
+    }
+    state->tokens[1 - i].Cancel();
+    state->resolver.Resolve(std::move(*result));
+  }
+
+  std::atomic<bool> done;
+  std::atomic<bool> hedged;
+  // How many attempts were cancelled without the Hedge cancelling them.
+  std::atomic<int> failed;
+  // Only read by the primary attempt, which starts after it is set.
+  uint64_t timer;
+  std::function<Promise<T>(CancellationToken)> backup;
+  CancellationToken tokens[2];
+  HedgeStats *stats;
+  Resolver<T> resolver;
+};
+
+template <typename T>
+Promise<T> Hedge(std::function<Promise<T>(CancellationToken)> primary,
+                 std::function<Promise<T>(CancellationToken)> backup,
+                 std::chrono::nanoseconds delay, HedgeStats *stats,
+                 std::string id) {
+  if (stats) {
+    stats->calls++;
+  }
+  auto pair = EventQueue::CreateResolver<T>(std::move(id));
+  auto state = std::allocate_shared<HedgeState<T>>(
+      PoolAllocator<HedgeState<T>>(), std::move(backup), stats,
+      std::move(pair.second));
+  state->timer =
+      Timer::Get()->Schedule(Timer::Get()->Now() + delay, [state]() {
+        HedgeState<T>::StartBackup(state);
+      });
+  HedgeState<T>::Start(state, 0, primary);
+  return pair.first;
+}
+
+template <typename T>
+Promise<T> Hedge(EventQueue *primary, EventQueue *backup, std::function<T()> f,
+                 std::chrono::nanoseconds delay, HedgeStats *stats,
+                 std::string id) {
+  return Hedge<T>(
+      [primary, f, id](CancellationToken token) {
+        return primary->Enqueue<T>(f, std::move(token), id);
+      },
+      [backup, f, id](CancellationToken token) {
+        return backup->Enqueue<T>(f, std::move(token), id);
+      },
+      delay, stats, id);
+}
+
 }  // namespace cpppromise
@@ -5,4 +5,6 @@
 class PromiseListener {
  public:
   virtual void OnResolved() = 0;
+  // Called instead of OnResolved if the promise is cancelled.
+  virtual void OnCancelled() {}
 };
\ No newline at end of file
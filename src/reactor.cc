@@ -0,0 +1,161 @@
+#include "reactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+
+namespace cpppromise {
+
+namespace {
+
+// The most events a single epoll_wait reports.
+constexpr int kMaxEvents = 64;
+
+}  // namespace
+
+Reactor::Reactor()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      waiting_(false) {
+  assert(epoll_fd_ >= 0);
+  assert(event_fd_ >= 0);
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = event_fd_;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+}
+
+Reactor::~Reactor() {
+  close(event_fd_);
+  close(epoll_fd_);
+}
+
+void Reactor::WhenReadable(int fd, TaskFunction ready) {
+  Watch(fd, false, std::move(ready));
+}
+
+void Reactor::WhenWritable(int fd, TaskFunction ready) {
+  Watch(fd, true, std::move(ready));
+}
+
+bool Reactor::Update(int fd, const Interest &interest, bool registered) {
+  uint32_t events = (interest.readers.empty() ? 0 : uint32_t{EPOLLIN}) |
+                    (interest.writers.empty() ? 0 : uint32_t{EPOLLOUT});
+  if (events == 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    return true;
+  }
+  epoll_event event{};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+                &event) == 0) {
+    return true;
+  }
+  // epoll forgets about a file descriptor once it is closed, so a new one with
+  // the same number has to be added afresh.
+  return registered && errno == ENOENT &&
+         epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void Reactor::Watch(int fd, bool write, TaskFunction ready) {
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    auto [it, inserted] = interests_.try_emplace(fd);
+    std::vector<TaskFunction> &callbacks =
+        write ? it->second.writers : it->second.readers;
+    callbacks.push_back(std::move(ready));
+    if (Update(fd, it->second, !inserted)) {
+      return;
+    }
+    ready = std::move(callbacks.back());
+    callbacks.pop_back();
+    if (inserted) {
+      interests_.erase(it);
+    }
+  }
+  ready();
+}
+
+void Reactor::PrepareWait() {
+  waiting_.store(true, std::memory_order_relaxed);
+  // Pairs with the fence in Notify, like in EventCount.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Reactor::CancelWait() {
+  waiting_.store(false, std::memory_order_relaxed);
+}
+
+int Reactor::Wait() {
+  int called = Dispatch(-1);
+  waiting_.store(false, std::memory_order_relaxed);
+  return called;
+}
+
+int Reactor::Poll() { return Dispatch(0); }
+
+void Reactor::Notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // Only the first notifier needs to write to the eventfd.
+  if (!waiting_.load(std::memory_order_relaxed) ||
+      !waiting_.exchange(false, std::memory_order_relaxed)) {
+    return;
+  }
+  uint64_t one = 1;
+  ssize_t written = write(event_fd_, &one, sizeof(one));
+  (void)written;
+}
+
+int Reactor::Dispatch(int timeout_ms) {
+  epoll_event events[kMaxEvents];
+  int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms);
+  std::vector<TaskFunction> ready;
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == event_fd_) {
+        uint64_t count;
+        ssize_t got = read(event_fd_, &count, sizeof(count));
+        (void)got;
+        continue;
+      }
+      auto it = interests_.find(fd);
+      if (it == interests_.end()) {
+        continue;
+      }
+      // After a hangup or an error, reads and writes fail right away, so
+      // everyone waiting gets to find out.
+      bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+      Interest &interest = it->second;
+      if ((events[i].events & EPOLLIN) || failed) {
+        for (auto &f : interest.readers) {
+          ready.push_back(std::move(f));
+        }
+        interest.readers.clear();
+      }
+      if ((events[i].events & EPOLLOUT) || failed) {
+        for (auto &f : interest.writers) {
+          ready.push_back(std::move(f));
+        }
+        interest.writers.clear();
+      }
+      Update(fd, interest, true);
+      if (interest.readers.empty() && interest.writers.empty()) {
+        interests_.erase(it);
+      }
+    }
+  }
+  // The callbacks may watch file descriptors again, so call them without the
+  // lock.
+  for (auto &f : ready) {
+    f();
+  }
+  return ready.size();
+}
+
+}  // namespace cpppromise
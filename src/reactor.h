@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "task_function.h"
+
+namespace cpppromise {
+
+// A Reactor lets one thread sleep until file descriptors become ready or until
+// another thread wakes it up, whichever comes first. It is built on epoll,
+// with an eventfd for the wakeups, and follows the same protocol as
+// EventCount, except that only one thread may wait:
+//
+//   if (!condition()) {
+//     reactor.PrepareWait();
+//     if (condition()) {
+//       reactor.CancelWait();
+//     } else {
+//       reactor.Wait();
+//     }
+//   }
+//
+// Like EventCount::Notify, Notify costs no more than a fence when the waiter
+// is not asleep.
+class Reactor {
+ public:
+  Reactor();
+
+  Reactor(const Reactor &) = delete;
+  Reactor &operator=(const Reactor &) = delete;
+
+  // Pending callbacks are destroyed without being called.
+  ~Reactor();
+
+  // Arrange for ready to be called, once, by the waiting thread when fd
+  // becomes readable, or hangs up or fails. Safe to call from any thread. fd
+  // must stay open until then. A file descriptor that epoll cannot watch, such
+  // as a regular file, which is always ready, is treated as ready right away:
+  // ready is called before WhenReadable returns.
+  void WhenReadable(int fd, TaskFunction ready);
+
+  // Like WhenReadable, but for fd becoming writable.
+  void WhenWritable(int fd, TaskFunction ready);
+
+  // Announce that the caller intends to Wait. The caller must then check its
+  // condition once more and call either CancelWait or Wait.
+  void PrepareWait();
+
+  // Withdraw the intention announced by PrepareWait.
+  void CancelWait();
+
+  // Block until Notify is called or some watched file descriptor is ready,
+  // then call the callbacks of those that are. Return the number of callbacks
+  // called.
+  int Wait();
+
+  // Like Wait, but without blocking.
+  int Poll();
+
+  // Wake up the waiter.
+  void Notify();
+
+ private:
+  // The callbacks waiting on one file descriptor.
+  struct Interest {
+    std::vector<TaskFunction> readers;
+    std::vector<TaskFunction> writers;
+  };
+
+  void Watch(int fd, bool write, TaskFunction ready);
+  int Dispatch(int timeout_ms);
+  // Tell epoll which events fd's interest covers now. Return false if epoll
+  // refuses to watch fd. Must hold mu_.
+  bool Update(int fd, const Interest &interest, bool registered);
+
+  int epoll_fd_;
+  int event_fd_;
+  // Whether the waiter may be asleep in epoll_wait, or about to be.
+  std::atomic<bool> waiting_;
+  // Guards interests_, which any thread may add to.
+  std::mutex mu_;
+  std::unordered_map<int, Interest> interests_;
+};
+
+}  // namespace cpppromise
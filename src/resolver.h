@@ -13,7 +13,15 @@ class Resolver {
 
   void Resolve(T result);
 
+  // Settle the Promise without a result, as if it had been given up on with a
+  // CancellationToken. Its continuations are skipped. Either this or Resolve
+  // may be called, once.
+  void Cancel();
+
  private:
+  template <typename U>
+  friend class PromiseControlBlock;
+
   std::shared_ptr<PromiseControlBlock<T>> pcb_;
 };
 
@@ -10,7 +10,12 @@ Resolver<T>::Resolver(std::shared_ptr<PromiseControlBlock<T>> pcb)
 
 template <typename T>
 void Resolver<T>::Resolve(T result) {
-  pcb_->Resolve(result);
+  pcb_->Resolve(std::move(result));
+}
+
+template <typename T>
+void Resolver<T>::Cancel() {
+  pcb_->Cancel();
 }
 
 }  // namespace cpppromise
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace cpppromise {
+
+// An InlineFunction<R(Args...)> is a move-only equivalent of
+// std::function<R(Args...)>. Callables of up to kInlineSize bytes are stored
+// inside the InlineFunction itself, so that wrapping the closures built by
+// EventQueue::Enqueue and Promise::Then does not allocate. Larger callables are
+// moved to the heap.
+template <typename Signature>
+class InlineFunction;
+
+template <typename R, typename... Args>
+class InlineFunction<R(Args...)> {
+ public:
+  static constexpr std::size_t kInlineSize = 64;
+
+  InlineFunction() noexcept : ops_(nullptr) {}
+
+  InlineFunction(std::nullptr_t) noexcept : ops_(nullptr) {}
+
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<
+                            std::decay_t<F>, InlineFunction>>>
+  InlineFunction(F &&f) : ops_(&OpsFor<std::decay_t<F>>::kOps) {
+    using Stored = std::decay_t<F>;
+    if constexpr (IsInline<Stored>()) {
+      new (storage_) Stored(std::forward<F>(f));
+    } else {
+      *reinterpret_cast<Stored **>(storage_) = new Stored(std::forward<F>(f));
+    }
+  }
+
+  InlineFunction(InlineFunction &&other) noexcept : ops_(other.ops_) {
+    if (ops_) {
+      ops_->move(other.storage_, storage_);
+      other.ops_ = nullptr;
+    }
+  }
+
+  InlineFunction &operator=(InlineFunction &&other) noexcept {
+    if (this != &other) {
+      Reset();
+      ops_ = other.ops_;
+      if (ops_) {
+        ops_->move(other.storage_, storage_);
+        other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  InlineFunction(const InlineFunction &) = delete;
+  InlineFunction &operator=(const InlineFunction &) = delete;
+
+  ~InlineFunction() { Reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  R operator()(Args... args) {
+    return ops_->invoke(storage_, std::forward<Args>(args)...);
+  }
+
+ private:
+  // A hand-rolled vtable, one per stored callable type.
+  struct Ops {
+    R (*invoke)(void *storage, Args &&...args);
+    // Move-construct into "to" and destroy what is left in "from".
+    void (*move)(void *from, void *to);
+    void (*destroy)(void *storage);
+  };
+
+  template <typename F>
+  static constexpr bool IsInline() {
+    return sizeof(F) <= kInlineSize &&
+           alignof(F) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<F>;
+  }
+
+  template <typename F, bool = IsInline<F>()>
+  struct OpsFor {
+    static R Invoke(void *storage, Args &&...args) {
+      return (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+    }
+    static void Move(void *from, void *to) {
+      new (to) F(std::move(*static_cast<F *>(from)));
+      static_cast<F *>(from)->~F();
+    }
+    static void Destroy(void *storage) { static_cast<F *>(storage)->~F(); }
+    static constexpr Ops kOps = {&Invoke, &Move, &Destroy};
+  };
+
+  template <typename F>
+  struct OpsFor<F, false> {
+    static R Invoke(void *storage, Args &&...args) {
+      return (**static_cast<F **>(storage))(std::forward<Args>(args)...);
+    }
+    static void Move(void *from, void *to) {
+      *static_cast<F **>(to) = *static_cast<F **>(from);
+    }
+    static void Destroy(void *storage) { delete *static_cast<F **>(storage); }
+    static constexpr Ops kOps = {&Invoke, &Move, &Destroy};
+  };
+
+  void Reset() {
+    if (ops_) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  const Ops *ops_;
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+};
+
+// The tasks run by EventQueues.
+using TaskFunction = InlineFunction<void()>;
+
+}  // namespace cpppromise
@@ -5,42 +5,42 @@
 #include <iostream>
 #include <map>
 #include <mutex>
-#include <optional>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 
 namespace cpppromise {
 
-struct Task {
-  uint64_t id;
-  std::function<void()> callback;
-};
-
 class TimerImpl : public Timer {
  public:
-  TimerImpl() : run_(true), id_counter_(0) {
+  TimerImpl()
+      : run_(true), id_counter_(0), wake_time_(clock::time_point::max()) {
     t_ = std::thread([this]() {
       while (true) {
-        std::optional<Task> this_task;
+        std::function<void()> this_task;
 
         {
           std::unique_lock<std::mutex> lock(mu_);
           if (!run_) {
             break;
           } else if (tasks_.empty()) {
+            wake_time_ = clock::time_point::max();
             cond_.wait(lock);
           } else {
-            auto t = tasks_.begin()->first;
+            auto t = tasks_.begin()->first.first;
             if (t <= Now()) {
-              this_task = tasks_.begin()->second;
-              tasks_.erase(t);
+              this_task = std::move(tasks_.begin()->second);
+              index_.erase(tasks_.begin()->first.second);
+              tasks_.erase(tasks_.begin());
             } else {
+              wake_time_ = t;
               cond_.wait_for(lock, t - Now());
             }
           }
         }
 
-        if (this_task.has_value()) {
-          this_task.value().callback();
+        if (this_task) {
+          this_task();
         }
       }
     });
@@ -60,32 +60,46 @@ class TimerImpl : public Timer {
   uint64_t Schedule(clock::time_point when, std::function<void()> f) override {
     std::unique_lock<std::mutex> lock(mu_);
     uint64_t id = id_counter_++;
-    tasks_.insert({when, {id, f}});
-    cond_.notify_one();
+    auto i = tasks_.emplace(std::make_pair(when, id), std::move(f)).first;
+    index_.emplace(id, i);
+    // The worker only needs to be woken up for a task that is due before it
+    // would wake up anyway. If it is awake, it sees the task itself.
+    if (when < wake_time_) {
+      wake_time_ = when;
+      cond_.notify_one();
+    }
     return id;
   }
 
+  // Cancelling a task costs a hash lookup and a single erase, however many
+  // are scheduled. The worker is not woken up: if the task was the first, it
+  // wakes up at its time, finds nothing due, and goes back to sleep.
   virtual bool Cancel(uint64_t id) {
     std::unique_lock<std::mutex> lock(mu_);
-    for (auto i = tasks_.cbegin(); i != tasks_.cend();) {
-      if (i->second.id == id) {
-        tasks_.erase(i);
-        cond_.notify_one();
-        return true;
-      } else {
-        ++i;
-      }
+    auto i = index_.find(id);
+    if (i == index_.end()) {
+      return false;
     }
-    return false;
+    tasks_.erase(i->second);
+    index_.erase(i);
+    return true;
   }
 
  private:
   bool run_;
   uint64_t id_counter_;
+  // When the worker, if it is asleep, wakes up by itself.
+  clock::time_point wake_time_;
   std::mutex mu_;
   std::thread t_;
   std::condition_variable cond_;
-  std::map<clock::time_point, Task> tasks_;
+  // The tasks in the order they are due, by time and then by ID, so that
+  // tasks due at the same time do not collide.
+  using Tasks =
+      std::map<std::pair<clock::time_point, uint64_t>, std::function<void()>>;
+  Tasks tasks_;
+  // Where each scheduled task is in tasks_, by ID.
+  std::unordered_map<uint64_t, Tasks::iterator> index_;
 };
 
 static TimerImpl timer;
@@ -147,5 +147,42 @@ TEST(TimerTest, CanCancel) {
   }
 }
 
+TEST(TimerTest, TasksDueAtTheSameTime) {
+  constexpr int n = 3;
+  std::mutex mu;
+  std::condition_variable cond;
+  int num_calls = 0;
+
+  Timer::clock::time_point when =
+      Timer::Get()->Now() + std::chrono::milliseconds(1);
+  for (int i = 0; i < n; i++) {
+    Timer::Get()->Schedule(when, [&mu, &cond, &num_calls]() {
+      std::unique_lock<std::mutex> lock(mu);
+      num_calls++;
+      cond.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock(mu);
+  cond.wait(lock, [&num_calls]() { return num_calls == n; });
+}
+
+TEST(TimerTest, CancelAmongMany) {
+  constexpr int n = 100000;
+  Timer::clock::time_point when =
+      Timer::Get()->Now() + std::chrono::hours(1);
+  std::vector<uint64_t> ids;
+  for (int i = 0; i < n; i++) {
+    ids.push_back(Timer::Get()->Schedule(when + std::chrono::nanoseconds(i % 7),
+                                         []() {}));
+  }
+  for (uint64_t id : ids) {
+    EXPECT_TRUE(Timer::Get()->Cancel(id));
+  }
+  for (uint64_t id : ids) {
+    EXPECT_FALSE(Timer::Get()->Cancel(id));
+  }
+}
+
 }  // namespace
 }  // namespace cpppromise